@@ -1,15 +1,23 @@
 ;; ay_uart.asm - AY-3-8912 UART bit-banging driver
-;; Based on proven SnapZX/BridgeZX code
+;; Started from the SnapZX/BridgeZX routines; the receive side is now a
+;; block engine with CTS flow control and C-computed timing tables
 ;; TX: Port A bit 3
 ;; RX: Port A bit 7
-;; Baud: 9600
+;; Baud: any rate, timing tables computed from C (uart_set_baud)
 
     SECTION code_user
 
     PUBLIC _ay_uart_init
     PUBLIC _ay_uart_send
+    PUBLIC _ay_uart_send_block
     PUBLIC _ay_uart_read
     PUBLIC _ay_uart_ready
+    PUBLIC _ay_uart_read_block
+    PUBLIC _ay_uart_rx_delays
+    PUBLIC _ay_uart_tx_delays
+    PUBLIC _ay_uart_rx_slack
+    PUBLIC _ay_uart_measure
+    PUBLIC _ay_uart_edges
 
 ;; ============================================================
 ;; DATA SEQUENCE FOR SPEED INITIALIZATION
@@ -51,12 +59,33 @@ defc dataSize = dataSequenceEnd - dataSequence
 ;; ============================================================
 ;; VARIABLES
 ;; ============================================================
+;;
+;; Bit timing is table driven: every bit runs a fixed amount of
+;; code plus a 'dec a / jp nz' loop (14 T-states per turn) whose
+;; count comes from these tables. The C side fills them for the
+;; selected baud rate so that the error does not accumulate
+;; across the byte. Fixed costs (T-states, loop excluded):
+;;   RX start edge -> bit 0 sample : 85 (18 avg poll latency)
+;;   RX sample -> next sample      : 37
+;;   TX edge -> next edge          : 48
+;;   TX stop edge -> return        : 23
+;;   Block TX return -> next start : 110
+;; ay_uart_measure counts 36 T-state polls; each edge taken adds
+;; 48 T-states that are not counted.
 
     SECTION bss_user
 
-_baud:              defs 2      ; Baud rate delay value (11 for 9600)
 _isSecondByteAvail: defs 1      ; Second byte available flag  
 _secondByte:        defs 1      ; Cached second byte
+_ay_uart_rx_delays: defs 8      ; Loops: start edge -> bit 0, then bit to bit
+_ay_uart_tx_delays: defs 10     ; Loops: start bit, 8 data bits, stop bits
+
+blkStart:           defs 2      ; read_block: start of destination buffer
+blkIdle:            defs 1      ; read_block: idle timeout (256 polls units)
+blkPortHi:          defs 1      ; read_block: port A state with CTS high
+_ay_uart_rx_slack:  defs 1      ; read_block: bytes allowed after 'max'
+readByte:           defs 2      ; ay_uart_read: byte + one in flight
+_ay_uart_edges:     defs 10     ; measure: polls from start bit to 5 edges
 
     SECTION code_user
 
@@ -119,10 +148,6 @@ initFlush:
     halt
     djnz initFlush
     
-    ; Set baud rate
-    ld hl, 11               ; 9600 baud
-    ld (_baud), hl
-    
     ; Clear second byte cache
     xor a
     ld (_isSecondByteAvail), a
@@ -132,6 +157,128 @@ initFlush:
     
     ret
 
+;; ============================================================
+;; txByte - Send one byte, 1 start + 8 data + stop bits
+;; Input: E = byte, BC = 0xBFFD (AY reg 14 selected)
+;;        D = port A value with TX (bit 3) low
+;; Uses:  A, E, HL. Interrupts must be disabled.
+;; ============================================================
+txByte:
+    ld hl, _ay_uart_tx_delays
+    or a                    ; Carry = 0: start bit
+    
+    ; Start bit + 8 data bits, unrolled so every bit costs the same:
+    ; carry -> TX line, wait, next bit into carry
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay0:
+    dec a
+    jp nz, txDelay0
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay1:
+    dec a
+    jp nz, txDelay1
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay2:
+    dec a
+    jp nz, txDelay2
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay3:
+    dec a
+    jp nz, txDelay3
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay4:
+    dec a
+    jp nz, txDelay4
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay5:
+    dec a
+    jp nz, txDelay5
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay6:
+    dec a
+    jp nz, txDelay6
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay7:
+    dec a
+    jp nz, txDelay7
+    rr e
+    
+    sbc a, a
+    and 0x08
+    or d
+    out (c), a
+    ld a, (hl)
+    inc hl
+txDelay8:
+    dec a
+    jp nz, txDelay8
+    rr e
+    
+    ; Stop bits (same cost as a data bit up to the edge)
+    ld a, d
+    or 0x08
+    nop
+    out (c), a
+    ld a, (hl)
+txDelayStop:
+    dec a
+    jp nz, txDelayStop
+    ret
+
 ;; ============================================================
 ;; ay_uart_send - Send a byte (fastcall: byte in L)
 ;; ============================================================
@@ -142,66 +289,16 @@ _ay_uart_send:
     push bc
     push af
     
-    ld a, l                 ; Get byte to send
-    push af                 ; Save it
-    
-    ld c, 0xFD              ; Prepare port addresses
-    ld d, 0xFF
-    ld e, 0xBF
-    ld b, d
+    ld e, l                 ; Byte to send
     
+    ld bc, 0xFFFD
     ld a, 0x0E
     out (c), a              ; Select AY's PORT A
+    ld b, 0xBF
+    ld d, 0xF6              ; TX low, CTS high
     
-    ld hl, (_baud)
-    ld de, 0x0002
-    or a
-    sbc hl, de
-    ex de, hl               ; DE = baud - 2
-    
-    pop af                  ; Get byte back
-    cpl                     ; Complement it
-    scf                     ; Set carry for start bit
-    ld b, 11                ; 1 start + 8 data + 2 stop bits
-    
-transmitBit:
-    push bc
-    push af
-    
-    ld a, 0xFE
-    ld h, d
-    ld l, e
-    ld bc, 0xBFFD
-    jp nc, transmitOne
-    
-    ; Transmit Zero (bit 3 = 0):
-    and 0xF7
-    out (c), a
-    jr transmitNext
-    
-transmitOne:
-    ; Transmit One (bit 3 = 1):
-    or 0x08
-    out (c), a
-    jr transmitNext
-    
-transmitNext:
-    dec hl
-    ld a, h
-    or l
-    jr nz, transmitNext
-    
-    nop
-    nop
-    nop
-    
-    pop af
-    pop bc
-    or a
-    rra                     ; Rotate right through carry
-    djnz transmitBit
+    call txByte
     
-    exx
     ei
     
     pop af
@@ -210,6 +307,52 @@ transmitNext:
     pop hl
     ret
 
+;; ============================================================
+;; ay_uart_send_block - Send a buffer with the port set up once
+;; C: void ay_uart_send_block(const uint8_t *buf, uint16_t len) __smallc
+;; Bytes go out back to back: each start bit follows the
+;; previous stop bits after only the loop overhead.
+;; ============================================================
+_ay_uart_send_block:
+    ld hl, 2
+    add hl, sp
+    ld e, (hl)
+    inc hl
+    ld d, (hl)              ; DE = len (last argument, smallc order)
+    inc hl
+    ld a, (hl)
+    inc hl
+    ld h, (hl)
+    ld l, a                 ; HL = buf
+    
+    di
+    
+    exx                     ; HL' = buf, DE' = bytes left
+    ld bc, 0xFFFD
+    ld a, 0x0E
+    out (c), a              ; Select AY's PORT A
+    ld b, 0xBF
+    ld d, 0xF6              ; TX low, CTS high
+
+sendBlockLoop:
+    exx
+    ld a, d
+    or e
+    jr z, sendBlockDone
+    dec de
+    ld a, (hl)
+    inc hl
+    exx
+    
+    ld e, a
+    call txByte
+    jr sendBlockLoop
+
+sendBlockDone:
+    exx
+    ei
+    ret
+
 ;; ============================================================
 ;; ay_uart_ready - Check if data available
 ;; Output: L = 1 if ready, 0 if not
@@ -260,200 +403,381 @@ _ay_uart_read:
     ret
 
 startReadByte:
-    di
+    ; One-byte block with one byte of slack: a byte already in
+    ; flight after it goes to the _secondByte cache
+    exx
+    ld hl, readByte
+    ld de, 1
+    ld bc, 0x0201           ; ~5 ms without start bit, 1 byte slack
+    exx
+    call readBlock
     
-    xor a
+    ld a, l
+    or a
+    ret z                   ; Timeout - return 0
+    dec a
+    jr z, readOne
+    ld a, (readByte + 1)
+    ld (_secondByte), a
+    ld a, 1
+    ld (_isSecondByteAvail), a
+readOne:
+    ld a, (readByte)
+    ld l, a
+    ret
+
+;; ============================================================
+;; ay_uart_read_block - Read a burst of bytes into a buffer
+;; C: uint16_t ay_uart_read_block(uint8_t *buf, uint16_t max,
+;;                                uint8_t idle) __smallc
+;; Stays in the sampling loop with interrupts off, storing
+;; back-to-back bytes until 'max' bytes are in 'buf' or no
+;; start bit is seen for 'idle' x 256 polls (~9200 T-states
+;; each unit). CTS is low only while sampling. Once 'max' is
+;; reached CTS goes high and up to _ay_uart_rx_slack bytes the
+;; ESP already had in flight still go to 'buf' (the caller must
+;; leave room for them); anything after that is lost.
+;; Output: HL = number of bytes stored
+;; ============================================================
+_ay_uart_read_block:
+    exx
+    ld hl, 2
+    add hl, sp
+    ld b, (hl)              ; B' = idle (last argument, smallc order)
+    inc hl
+    inc hl
+    ld e, (hl)
+    inc hl
+    ld d, (hl)              ; DE' = max
+    inc hl
+    ld a, (hl)
+    inc hl
+    ld h, (hl)
+    ld l, a                 ; HL' = buf
+    ld a, (_ay_uart_rx_slack)
+    ld c, a                 ; C' = slack
+    exx
+
+;; Internal entry, arguments in the alternate set:
+;; HL' = buf, DE' = max, B' = idle, C' = slack. Whole receive
+;; runs with HL' as destination, DE' as free bytes, B' as idle
+;; reload and C' as the free bytes for after 'max'.
+readBlock:
     exx
-    ld de, (_baud)
-    ld hl, (_baud)
-    srl h
-    rr l                    ; HL = _baud/2
+    ld (blkStart), hl
+    ld a, b
+    ld (blkIdle), a
+    ld a, d
+    or e
+    jr z, blockNoRoom       ; max = 0, nothing to do
+    
+    ; Byte cached by a previous read goes first
+    ld a, (_isSecondByteAvail)
     or a
-    ld b, 0xFA              ; Wait loop length (timeout)
+    jr z, blockSetup
+    xor a
+    ld (_isSecondByteAvail), a
+    ld a, (_secondByte)
+    ld (hl), a
+    inc hl
+    dec de
+    ld a, d
+    or e
+    jr nz, blockSetup
+
+blockNoRoom:
+    push hl
     exx
+    pop hl
+    jp blockReturn
+
+blockSetup:
+    exx
+    ld a, (blkIdle)
+    ld d, a                 ; D = idle units left
+    ld l, 0
     
-    ld c, 0xFD
-    ld d, 0xFF
-    ld e, 0xBF
-    ld b, d
+    di
     
+    ld bc, 0xFFFD
     ld a, 0x0E
-    out (c), a
+    out (c), a              ; Select AY's PORT A
     in a, (c)
     or 0xF0                 ; Input lines to 1
-    and 0xFB                ; CTS force to 0
-    ld b, e
-    out (c), a              ; Update port
-    ld h, a                 ; Save port state
+    and 0xFB                ; CTS low while we sample
+    ld b, 0xBF
+    out (c), a
+    or 0x04
+    ld (blkPortHi), a       ; Same with CTS set
+    ld b, 0xFF
+
+blockWaitStart:
+    in a, (c)
+    jp p, blockStartBit     ; RX (bit 7) low: start bit
+    dec l
+    jp nz, blockWaitStart
+    dec d
+    jp nz, blockWaitStart
+    jp blockFinish          ; Line idle, burst is over
+
+blockStartBit:
+    ; Verify start bit (debounce)
+    in a, (c)
+    jp m, blockWaitStart
+    
+    ld hl, _ay_uart_rx_delays
     
-waitStartBit:
-    ld b, d
+    ; 8 data bits, unrolled so every sample costs the same:
+    ; wait, sample RX, shift it into E (LSB first)
+    ld a, (hl)
+    inc hl
+rxDelay0:
+    dec a
+    jp nz, rxDelay0
     in a, (c)
-    and 0x80
-    jr z, startBitFound
+    rla
+    rr e
     
-readTimeOut:
-    exx
-    dec b
-    exx
-    jr nz, waitStartBit
+    ld a, (hl)
+    inc hl
+rxDelay1:
+    dec a
+    jp nz, rxDelay1
+    in a, (c)
+    rla
+    rr e
     
-    ; Timeout - return 0
-    ld l, 0
-    ei
-    ret
-
-startBitFound:
-    ; Verify start bit (debounce)
+    ld a, (hl)
+    inc hl
+rxDelay2:
+    dec a
+    jp nz, rxDelay2
     in a, (c)
-    and 0x80
-    jr nz, readTimeOut
+    rla
+    rr e
     
+    ld a, (hl)
+    inc hl
+rxDelay3:
+    dec a
+    jp nz, rxDelay3
     in a, (c)
-    and 0x80
-    jr nz, readTimeOut
+    rla
+    rr e
+    
+    ld a, (hl)
+    inc hl
+rxDelay4:
+    dec a
+    jp nz, rxDelay4
+    in a, (c)
+    rla
+    rr e
+    
+    ld a, (hl)
+    inc hl
+rxDelay5:
+    dec a
+    jp nz, rxDelay5
+    in a, (c)
+    rla
+    rr e
+    
+    ld a, (hl)
+    inc hl
+rxDelay6:
+    dec a
+    jp nz, rxDelay6
+    in a, (c)
+    rla
+    rr e
     
-    ; Start bit confirmed!
+    ld a, (hl)
+    inc hl
+rxDelay7:
+    dec a
+    jp nz, rxDelay7
+    in a, (c)
+    rla
+    rr e
+    
+    ; Store byte, count it and reload the idle timeout
+    ld a, e
     exx
-    ld bc, 0xFFFD
-    ld a, 0x80
-    ex af, af'
-
-readTune:
-    add hl, de              ; HL = 1.5 * _baud
-    nop
-    nop
-    nop
-    nop                     ; Fine tuning delay
+    ld (hl), a
+    inc hl
+    dec de
+    ld a, d
+    or e
+    ld a, b
+    exx
+    ld d, a
+    jp z, blockFull
 
-bdDelay:
-    dec hl
-    ld a, h
-    or l
-    jr nz, bdDelay
-    
+blockStopIdle:
+    ld l, 0                 ; L was the table pointer: full idle unit again
+blockWaitStop:
+    ; Last data bit may be 0: wait for the stop bit before
+    ; looking for the next start bit
     in a, (c)
-    and 0x80
-    jp z, zeroReceived
-    
-    ; One received:
-    ex af, af'
-    scf
-    rra
-    jr c, receivedByte
-    ex af, af'
-    jp readTune
-
-zeroReceived:
-    ex af, af'
-    or a
-    rra
-    jr c, receivedByte
-    ex af, af'
-    jp readTune
+    jp m, blockWaitStart
+    dec l
+    jp nz, blockWaitStop
+    dec d
+    jp nz, blockWaitStop
+    jp blockFinish          ; Line stuck low (break)
 
-receivedByte:
-    scf
-    push af
+blockFull:
+    ; 'max' reached: set CTS and give the slack bytes a chance.
+    ; Runs inside the stop bit, so keep it short
+    ld a, (blkPortHi)
+    ld b, 0xBF
+    out (c), a              ; Set CTS
+    ld b, 0xFF
     exx
+    ld a, c
+    ld e, a                 ; DE' = slack (D' is 0)
+    ld c, d                 ; No slack after this
+    exx
+    or a
+    jp nz, blockStopIdle
 
-readFinish:
-    ld a, h
-    or 0x04                 ; Set CTS
-    ld b, e
-    out (c), a
-    
+blockFinish:
+    ld a, (blkPortHi)
+    ld b, 0xBF
+    out (c), a              ; Set CTS
+    ei
     exx
-    ld h, d
-    ld l, e
-    
-    ld bc, 0x0007
+
+blockReturn:
+    ld de, (blkStart)
     or a
-    sbc hl, bc
+    sbc hl, de              ; HL = bytes stored
+    ret
 
-delayForStopBit:
-    dec hl
-    ld a, h
-    or l
-    jr nz, delayForStopBit
+;; ============================================================
+;; ay_uart_measure - Time the edges of one received byte
+;; C: uint8_t ay_uart_measure(uint8_t idle) __z88dk_fastcall
+;; Waits up to 'idle' x 256 polls for a start bit, then stores in
+;; _ay_uart_edges the poll count (36 T-states each) at each of the
+;; next 5 edges. For '\r' (0x0D) they fall 1, 2, 3, 5 and 9 bits
+;; after the start edge, which lets the C side work out the bit
+;; time of the running machine.
+;; Output: L = 1 if 5 edges were seen, 0 on timeout
+;; ============================================================
+_ay_uart_measure:
+    ld d, l                 ; D = idle units
+    ld l, 0
+    
+    di
     
     ld bc, 0xFFFD
-    add hl, de
-    add hl, de
-    add hl, de
+    ld a, 0x0E
+    out (c), a              ; Select AY's PORT A
+    in a, (c)
+    or 0xF0                 ; Input lines to 1
+    and 0xFB                ; CTS low while we sample
+    ld b, 0xBF
+    out (c), a
+    or 0x04
+    ld (blkPortHi), a       ; Same with CTS set
+    ld b, 0xFF
 
-waitStartBitSecondByte:
+measWaitStart:
     in a, (c)
-    and 0x80
-    jr z, secondStartBitFound
-    dec hl
-    ld a, h
-    or l
-    jr nz, waitStartBitSecondByte
-    
-    ; No second byte
-    pop af
-    ld l, a
-    ei
-    ret
+    jp p, measStart         ; RX (bit 7) low: start bit
+    dec l
+    jp nz, measWaitStart
+    dec d
+    jp nz, measWaitStart
+    jr measFail
 
-secondStartBitFound:
-    ; Verify
+measStart:
+    ld hl, _ay_uart_edges
+    ld de, 0
+    
+    ; Count polls up to each edge, alternating polarity. D:E
+    ; keeps counting across edges; D reaching 128 means the
+    ; line got stuck
+measWait0:
     in a, (c)
-    and 0x80
-    jr nz, waitStartBitSecondByte
-    
-    ld h, d
-    ld l, e
-    ld bc, 0x0002
-    srl h
-    rr l
-    or a
-    sbc hl, bc
-    ld bc, 0xFFFD
-    ld a, 0x80
-    ex af, af'
+    jp m, measEdge0     ; RX high
+    inc e
+    jp nz, measWait0
+    inc d
+    jp p, measWait0
+    jp measFail
+measEdge0:
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
 
-secondByteTune:
-    nop
-    nop
-    nop
-    nop
-    add hl, de
+measWait1:
+    in a, (c)
+    jp p, measEdge1     ; RX low
+    inc e
+    jp nz, measWait1
+    inc d
+    jp p, measWait1
+    jp measFail
+measEdge1:
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
 
-secondDelay:
-    dec hl
-    ld a, h
-    or l
-    jr nz, secondDelay
-    
+measWait2:
     in a, (c)
-    and 0x80
-    jr z, secondZeroReceived
-    
-    ; Second 1 received
-    ex af, af'
-    scf
-    rra
-    jr c, secondByteFinished
-    ex af, af'
-    jp secondByteTune
-
-secondZeroReceived:
-    ex af, af'
-    or a
-    rra
-    jr c, secondByteFinished
-    ex af, af'
-    jp secondByteTune
+    jp m, measEdge2     ; RX high
+    inc e
+    jp nz, measWait2
+    inc d
+    jp p, measWait2
+    jp measFail
+measEdge2:
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
 
-secondByteFinished:
-    ld hl, _isSecondByteAvail
-    ld (hl), 1
+measWait3:
+    in a, (c)
+    jp p, measEdge3     ; RX low
+    inc e
+    jp nz, measWait3
+    inc d
+    jp p, measWait3
+    jp measFail
+measEdge3:
+    ld (hl), e
     inc hl
-    ld (hl), a
-    
-    pop af
-    ld l, a
+    ld (hl), d
+    inc hl
+
+measWait4:
+    in a, (c)
+    jp m, measEdge4     ; RX high
+    inc e
+    jp nz, measWait4
+    inc d
+    jp p, measWait4
+    jp measFail
+measEdge4:
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
+
+    ld l, 1
+    jr measDone
+
+measFail:
+    ld l, 0
+
+measDone:
+    ld a, (blkPortHi)       ; Set CTS
+    ld b, 0xBF
+    out (c), a
     ei
     ret
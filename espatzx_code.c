@@ -1,6 +1,7 @@
 #include <string.h>
 #include <input.h>
 #include <arch/zx.h>
+#include <arch/zx/esxdos.h>
 #include <stdint.h>
 
 // ============================================================
@@ -9,8 +10,15 @@
 
 extern void ay_uart_init(void);
 extern void ay_uart_send(uint8_t c) __z88dk_fastcall;
+extern void ay_uart_send_block(const uint8_t *buf, uint16_t len) __smallc;
 extern uint8_t ay_uart_ready(void);
 extern uint8_t ay_uart_read(void);
+extern uint16_t ay_uart_read_block(uint8_t *buf, uint16_t max, uint8_t idle) __smallc;
+extern uint8_t ay_uart_rx_slack;
+extern uint8_t ay_uart_rx_delays[8];
+extern uint8_t ay_uart_tx_delays[10];
+extern uint8_t ay_uart_measure(uint8_t idle) __z88dk_fastcall;
+extern uint16_t ay_uart_edges[5];
 static void uart_flush_rx(void);
 
 // ============================================================
@@ -42,44 +50,155 @@ static void uart_flush_rx(void);
 // RING BUFFER (Buffer Circular para RX)
 // ============================================================
 
-#define RING_BUFFER_SIZE 256 
+// Tamaño configurable al compilar (zcc ... -DRING_BUFFER_SIZE=4096).
+// Potencia de 2: el wrap es un AND con la máscara. Con menos de 512 una
+// línea sin fin cerca de SPAN_MAX llena el buffer antes de cortarse y la
+// recepción se para. Por arriba manda la memoria: el buffer va dentro del
+// programa, que carga en 32768 y tiene que acabar antes de los UDG (el
+// Makefile comprueba el binario)
+#ifndef RING_BUFFER_SIZE
+#define RING_BUFFER_SIZE 2048
+#endif
+#define RB_MASK (RING_BUFFER_SIZE - 1)
+
+#if (RING_BUFFER_SIZE & RB_MASK) || RING_BUFFER_SIZE < 512 || RING_BUFFER_SIZE > 4096
+#error "RING_BUFFER_SIZE must be a power of 2 between 512 and 4096"
+#endif
+
 static uint8_t ring_buffer[RING_BUFFER_SIZE];
-static uint8_t rb_head = 0; // Donde escribimos
-static uint8_t rb_tail = 0; // Desde donde leemos
+static uint16_t rb_head = 0; // Donde escribimos
+static uint16_t rb_tail = 0; // Desde donde leemos
+static uint8_t rb_line_len = 0; // Bytes de la línea en curso ya revisados
+static uint16_t rx_ipd_left = 0; // Bytes de la carga de un +IPD aún por leer
+
+// Contadores de la cadena de recepción (!STATS). Dicen dónde se pierde o
+// se recorta una respuesta para ajustar buffer y velocidad
+static struct {
+    uint32_t rx_bytes;      // Bytes guardados en el ring buffer
+    uint16_t rb_peak;       // Máxima ocupación del ring buffer
+    uint16_t full_stops;    // Drenajes parados por buffer lleno sin control de flujo
+                            // (cada uno pierde al menos el byte que llegaba)
+    uint16_t flushed;       // Bytes tirados por uart_flush_rx()
+    uint16_t long_lines;    // Líneas cortadas en SPAN_MAX
+    uint16_t binary_bytes;  // Bytes no imprimibles quitados de las líneas
+    uint16_t noise_lines;   // Líneas de ruido asíncrono descartadas
+} rx_stats;
+
+// Bytes libres en total
+static uint16_t rb_free(void)
+{
+    return (rb_tail - rb_head - 1) & RB_MASK;
+}
+
+// Unidades de 256 polls (~2.6 ms) sin bit de start que dan por terminada
+// una ráfaga
+#define UART_IDLE_UNITS 2
+
+// Con control de flujo el ESP solo transmite con CTS abajo, y eso solo pasa
+// dentro del driver: mientras C pinta o procesa, el ESP espera
+static uint8_t uart_flow = 0;
+
+// Tiempo que el driver pasa en DI, en T-states. FRAMES no avanza mientras
+// tanto, así que las medidas de tiempo lo suman aparte (elapsed_ms). Cada
+// espera sin datos cuenta una unidad de 256 polls de 36 T (blockWaitStart);
+// cada ráfaga, sus bytes en la línea más la unidad de reposo que la cierra
+// y media unidad, de media, antes del primero
+#define UART_UNIT_T (256UL * 36)
+
+static uint32_t uart_di_t = 0;
+static uint16_t uart_bit_t = 364;  // T-states por bit (uart_set_baud)
+
+// Bytes que el ESP aún puede mandar tras subir CTS. Se dejan libres por
+// encima de la marca de nivel alto del buffer
+#define RB_SLACK 4
 
-// Verifica si el buffer está lleno
-static uint8_t rb_full(void)
+// Hueco libre contiguo desde rb_head (sin cruzar el final del array)
+static uint16_t rb_contig_free(void)
 {
-    return ((uint8_t)(rb_head + 1) == rb_tail);
+    if (rb_tail > rb_head) return rb_tail - rb_head - 1;
+    return RING_BUFFER_SIZE - rb_head - (rb_tail == 0 ? 1 : 0);
 }
 
-// Vuelca todo lo que tenga el chip UART a la RAM inmediatamente
-static void uart_drain_to_buffer(void)
+// Vuelca a la RAM lo que mande el ESP. Con 'idle' el driver espera
+// siempre hasta esas unidades de 256 polls a que empiece algo. Devuelve
+// los bytes leídos
+static uint16_t uart_drain_wait(uint8_t idle)
 {
-    // Leemos hasta vaciar el chip o un máximo seguro para no bloquear
-    uint8_t max_loop = 32; 
-    while (ay_uart_ready() && max_loop > 0) {
-        // Protección de overflow: si buffer está casi lleno, dejar de leer
-        if (rb_full()) break;
+    uint16_t space, max, got, used, total = 0;
+    uint8_t units;
+    
+    // El driver se queda en el bucle de muestreo hasta que la línea queda
+    // en reposo, así no se pierden bytes seguidos entre llamadas desde C.
+    // Sin control de flujo solo merece la pena entrar si ya hay un bit de
+    // start; con él, el ESP no empieza hasta que el driver baja CTS
+    while (idle || uart_flow || ay_uart_ready()) {
+        // Marca de nivel alto: CTS se queda arriba hasta que C consuma.
+        // Sin control de flujo el byte que ya está llegando se pierde
+        if (rb_free() <= RB_SLACK) {
+            if (!uart_flow) rx_stats.full_stops++;
+            break;
+        }
+        
+        space = rb_contig_free();
+        ay_uart_rx_slack = (space > RB_SLACK) ? RB_SLACK : (uint8_t)(space - 1);
+        max = space - ay_uart_rx_slack;
+        units = idle ? idle : uart_flow ? 1 : UART_IDLE_UNITS;
+        got = ay_uart_read_block(&ring_buffer[rb_head], max, units);
+        rb_head = (rb_head + got) & RB_MASK;
+        rx_stats.rx_bytes += got;
+        total += got;
         
-        // Escribimos en head
-        ring_buffer[rb_head++] = ay_uart_read();
-        max_loop--;
+        if (!got) {
+            uart_di_t += units * UART_UNIT_T;
+        } else {
+            uart_di_t += (uint32_t)got * 10 * uart_bit_t;
+            if (got < max) uart_di_t += units * UART_UNIT_T;
+            // Sin control de flujo solo se entra con el start ya en marcha
+            if (idle || uart_flow) uart_di_t += UART_UNIT_T / 2;
+        }
+        
+        // Si no llegó a 'max', la ráfaga terminó. Si llegó, CTS subió y
+        // seguimos tras el wrap o hasta la marca de nivel alto
+        if (got < max) break;
     }
+    
+    used = (rb_head - rb_tail) & RB_MASK;
+    if (used > rx_stats.rb_peak) rx_stats.rb_peak = used;
+    return total;
+}
+
+// Vuelca todo lo que tenga el chip UART a la RAM inmediatamente
+static void uart_drain_to_buffer(void)
+{
+    uart_drain_wait(0);
 }
 
 // Saca un byte del buffer de RAM (si hay)
 static int16_t rb_pop(void)
 {
+    uint8_t c;
+    
     if (rb_head == rb_tail) return -1; // Buffer vacío
-    return ring_buffer[rb_tail++];
+    c = ring_buffer[rb_tail];
+    rb_tail = (rb_tail + 1) & RB_MASK;
+    rb_line_len = 0;
+    if (rx_ipd_left) rx_ipd_left--;
+    return c;
+}
+
+// Descarta lo pendiente en RAM sin tocar el hardware
+static void rb_discard(void)
+{
+    rb_head = rb_tail = 0; // Resetea índices
+    rb_line_len = 0;
+    rx_ipd_left = 0;
 }
 
 // Limpia el buffer completamente
 static void rb_flush(void)
 {
     uart_flush_rx(); // Limpia hardware
-    rb_head = rb_tail = 0; // Resetea índices
+    rb_discard();
 }
 
 #define LINE_BUFFER_SIZE 80
@@ -108,10 +227,11 @@ static uint8_t cursor_pos = 0;
 #define STATUS_RED     (PAPER_WHITE | INK_RED)
 #define STATUS_GREEN   (PAPER_WHITE | INK_GREEN)
 #define STATUS_YELLOW  (PAPER_WHITE | INK_YELLOW)
-// NUEVO: Definimos tiempos de espera
-#define TIMEOUT_STD  200000UL   // Timeout estándar para comandos AT
-#define TIMEOUT_FAST 25000UL    // Timeout rápido para queries simples
-#define TIMEOUT_LONG 500000UL   // Timeout largo para operaciones como SCAN o CONNECT
+// Tiempos de espera en milisegundos (ver TIMING)
+#define TIMEOUT_STD   15000     // Timeout estándar para comandos AT (sin líneas nuevas)
+#define TIMEOUT_FAST  2000      // Timeout rápido para queries simples
+#define TIMEOUT_LONG  20000     // Timeout largo para operaciones como SCAN o CONNECT
+#define TIMEOUT_PROBE 200       // Primer AT de probe_esp (un ESP listo contesta en <5 ms)
 static uint8_t current_attr = ATTR_USER;
 
 // Status bar data
@@ -122,6 +242,33 @@ static uint8_t connection_status = 0;
 static char device_time[6] = "--:--";
 static char device_at_ver[8] = "---";
 
+// ============================================================
+// TIMING (contador de frames de 50 Hz)
+// ============================================================
+
+// La ROM incrementa FRAMES en cada interrupción, así que los plazos no
+// dependen de lo que cueste cada vuelta del bucle ni del reloj de la CPU.
+// Mientras el driver recibe con DI se pierden frames: el plazo se alarga
+// lo que dure la ráfaga, que es justo cuando no conviene cortar
+#define FRAMES_ADDR 23672
+#define MS_TO_FRAMES(ms) ((uint16_t)((ms) / 20 + 1))
+
+static uint16_t timer_frames(void)
+{
+    return *(volatile uint16_t *)FRAMES_ADDR;
+}
+
+// Plazo a 'ms' de ahora (resolución 20 ms, hasta ~65 s)
+static uint16_t deadline_in(uint16_t ms)
+{
+    return timer_frames() + MS_TO_FRAMES(ms);
+}
+
+static uint8_t deadline_passed(uint16_t deadline)
+{
+    return (int16_t)(timer_frames() - deadline) >= 0;
+}
+
 // ============================================================
 // COMMAND HISTORY
 // ============================================================
@@ -377,6 +524,26 @@ static void int_to_str(int16_t val, char *buf)
     buf[i] = 0;
 }
 
+static void u16_to_dec(char *buf, uint16_t val)
+{
+    char tmp[6];
+    uint8_t j = 0;
+    
+    do { tmp[j++] = '0' + (val % 10); val /= 10; } while (val);
+    while (j > 0) *buf++ = tmp[--j];
+    *buf = 0;
+}
+
+static void u32_to_dec(char *buf, uint32_t val)
+{
+    char tmp[11];
+    uint8_t j = 0;
+    
+    do { tmp[j++] = '0' + (val % 10); val /= 10; } while (val);
+    while (j > 0) *buf++ = tmp[--j];
+    *buf = 0;
+}
+
 // Definiciones de colores locales para la barra
 #define ATTR_LBL (PAPER_WHITE | INK_BLUE)
 #define ATTR_VAL (PAPER_WHITE | INK_BLACK)
@@ -761,26 +928,148 @@ static void input_end(void) {
 // UART COMMUNICATION
 // ============================================================
 
-#define RX_LINE_SIZE 100
-static char rx_line[RX_LINE_SIZE];
-static uint8_t rx_pos = 0;
-
 #define RESP_WAITING    0
 #define RESP_GOT_OK     1
 #define RESP_GOT_ERROR  2
 #define RESP_TIMEOUT    3
+#define RESP_GOT_MATCH  4   // Un handler de at_transact() tiene lo que buscaba
+
+// Clase de cada línea recibida (ver LINE CLASSIFIER). Los terminadores
+// coinciden con RESP_GOT_OK/RESP_GOT_ERROR
+#define LINE_UNKNOWN    0   // Ni respuesta reconocida ni ruido conocido
+#define LINE_OK         1
+#define LINE_ERROR      2   // ERROR, FAIL
+#define LINE_DATA       3   // Respuesta para mostrar
+#define LINE_EVENT      4   // Mensaje asíncrono del ESP (WIFI..., CLOSED, +IPD...)
+#define LINE_NOISE      5   // IDs de conexión sueltos
 
 static void delay(uint16_t count) { while (count--) __asm__("nop"); }
 
+// ============================================================
+// BAUD RATE
+// ============================================================
+
+// Coste fijo en T-states de cada paso del driver (ver ay_uart.asm)
+#define UART_LOOP_T      14     // Una vuelta de 'dec a / jp nz'
+#define UART_RX_FIRST_T  85     // Flanco de start -> muestra del bit 0
+#define UART_RX_BIT_T    37     // Muestra -> muestra
+#define UART_TX_BIT_T    48     // Flanco -> flanco
+#define UART_TX_STOP_T   23     // Flanco de stop -> retorno
+#define UART_TX_BLOCK_T  110    // send_block: retorno -> siguiente start
+#define UART_MIN_BIT_T   88     // Por debajo no da tiempo entre bytes
+#define UART_MIN_FLOW_T  136    // Subir CTS en mitad de una ráfaga
+#define UART_DEF_BAUD    9600   // Velocidad del ESP tras un reset
+
+#define CPU_CLOCK_48K    3500000UL
+
+static const uint16_t baud_rates[] = { 9600, 19200, 38400, 57600 };
+#define BAUD_RATES_COUNT (sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+static uint32_t cpu_clock = CPU_CLOCK_48K;
+static uint16_t uart_baud = 9600;
+
+// Vueltas de bucle más cercanas a 't16' (T-states * 16)
+static uint8_t uart_loops(int32_t t16)
+{
+    int32_t n = (t16 + UART_LOOP_T * 8) / (UART_LOOP_T * 16);
+    if (n < 1) return 1;
+    if (n > 255) return 255;
+    return (uint8_t)n;
+}
+
+// Calcula las tablas del driver para un bit de 'bit_t16' T-states * 16.
+// Cada espera se calcula contra el instante ideal del bit, así el error de
+// redondeo no se acumula a lo largo del byte
+static void uart_calc_timing(uint16_t bit_t16, uint8_t *rx, uint8_t *tx)
+{
+    uint8_t i;
+    int32_t now;
+    
+    // RX: muestras en el centro de cada bit (1.5, 2.5... bits tras el flanco)
+    now = 0;
+    for (i = 0; i < 8; i++) {
+        now += (int32_t)(i == 0 ? UART_RX_FIRST_T : UART_RX_BIT_T) * 16;
+        rx[i] = uart_loops((int32_t)bit_t16 * (3 + 2 * i) / 2 - now);
+        now += (int32_t)rx[i] * UART_LOOP_T * 16;
+    }
+    
+    // TX: start + 8 datos en múltiplos exactos del bit, 2 bits de stop
+    now = 0;
+    for (i = 0; i < 9; i++) {
+        now += (int32_t)UART_TX_BIT_T * 16;
+        tx[i] = uart_loops((int32_t)bit_t16 * (i + 1) - now);
+        now += (int32_t)tx[i] * UART_LOOP_T * 16;
+    }
+    tx[9] = uart_loops((int32_t)bit_t16 * 2 - UART_TX_STOP_T * 16);
+}
+
+// ¿Puede el driver seguir esta velocidad con el reloj actual?
+static uint8_t uart_baud_usable(uint16_t rate)
+{
+    return (cpu_clock / rate) >= UART_MIN_BIT_T;
+}
+
+// ¿Y con control de flujo? Subir CTS al llenar el buffer cuesta tiempo en
+// el bit de stop
+static uint8_t uart_flow_usable(uint16_t rate)
+{
+    return (cpu_clock / rate) >= UART_MIN_FLOW_T;
+}
+
+static void uart_set_baud(uint16_t rate)
+{
+    uart_baud = rate;
+    uart_bit_t = (uint16_t)(cpu_clock / rate);
+    uart_calc_timing((uint16_t)((cpu_clock * 16UL) / rate), ay_uart_rx_delays, ay_uart_tx_delays);
+}
+
+// Tiempo real desde una marca. FRAMES cuenta lo que pasa con EI y pierde
+// las interrupciones que caen en DI; ese tiempo lo pone uart_di_t. Un frame
+// cuenta o no según dónde caiga su interrupción, así que el resultado es
+// exacto en promedio y tiene un error de +-20 ms
+typedef struct {
+    uint16_t frames;
+    uint32_t di_t;
+    uint16_t t_ms;      // T-states por ms
+} elapsed_mark;
+
+static void elapsed_start(elapsed_mark *m)
+{
+    m->frames = timer_frames();
+    m->di_t = uart_di_t;
+    m->t_ms = (uint16_t)(cpu_clock / 1000);
+}
+
+static uint32_t elapsed_ms(const elapsed_mark *m)
+{
+    return (uint32_t)(uint16_t)(timer_frames() - m->frames) * 20 + (uart_di_t - m->di_t) / m->t_ms;
+}
+
 static void uart_flush_rx(void)
 {
     uint16_t max_wait = 500;
     uint16_t max_bytes = 500;
+    uint16_t got;
+    uint8_t junk[16];
+    
+    // Con control de flujo no hay bit de start que esperar: se baja CTS
+    // y se tira lo que llegue hasta que el ESP se calle
+    if (uart_flow) {
+        ay_uart_rx_slack = RB_SLACK;
+        while (max_bytes > sizeof(junk)) {
+            got = ay_uart_read_block(junk, sizeof(junk) - RB_SLACK, 1);
+            rx_stats.flushed += got;
+            if (got < sizeof(junk) - RB_SLACK) break;
+            max_bytes -= sizeof(junk);
+        }
+        return;
+    }
     
     // Drain everything
     while (max_bytes > 0) {
         if (ay_uart_ready()) { 
             ay_uart_read(); 
+            rx_stats.flushed++;
             max_bytes--;
             max_wait = 100;
         } else {
@@ -805,487 +1094,818 @@ static void uart_flush_hard(void)
     uart_flush_rx();
 }
 
-static void uart_send_string(const char *s) { while (*s) ay_uart_send(*s++); }
-
-static uint8_t is_terminator(void)
+// El driver manda cada byte con dos bits de stop, en DI
+static void uart_send(const uint8_t *buf, uint16_t len)
 {
-    if (rx_pos == 2 && rx_line[0] == 'O' && rx_line[1] == 'K') return RESP_GOT_OK;
-    if (rx_pos >= 5 && rx_line[0] == 'E' && rx_line[1] == 'R' && rx_line[2] == 'R') return RESP_GOT_ERROR;
-    if (rx_pos >= 4 && rx_line[0] == 'F' && rx_line[1] == 'A' && rx_line[2] == 'I') return RESP_GOT_ERROR;
-    return 0;
+    ay_uart_send_block(buf, len);
+    uart_di_t += (uint32_t)len * 11 * uart_bit_t;
 }
 
-// Detecta mensajes asíncronos del ESP que debemos IGNORAR
-static uint8_t is_async_noise(void)
+static void uart_send_string(const char *s) { uart_send((const uint8_t *)s, strlen(s)); }
+
+// ============================================================
+// UART CALIBRATION
+// ============================================================
+
+// Coste de ay_uart_measure en T-states (ver ay_uart.asm)
+#define UART_MEAS_POLL_T  36
+#define UART_MEAS_EDGE_T  48
+
+#define UART_CAL_TRIES    4
+#define UART_CAL_IDLE     8     // Unidades de 256 polls (~20 ms a 3.5 MHz)
+
+// Relojes candidatos en múltiplos de 3.5 MHz (48K/128K, turbo 7 y 14 MHz)
+static const uint8_t cpu_clock_mul[] = { 1, 2, 4 };
+
+static uint16_t diff16(uint16_t a, uint16_t b) { return a > b ? a - b : b - a; }
+
+// Manda "AT" y mide el '\r' con que empieza la respuesta (con ATE0).
+// Sus flancos caen a 1, 2, 3, 5 y 9 bits del start: se comprueba el
+// patrón y se devuelve lo que duran los 8 bits entre el primer y el
+// último flanco de subida, en T-states (0 si la medida no vale)
+static uint16_t uart_measure_cr(uint8_t idle)
 {
-    if (rx_pos < 2) return 0;
+    uint16_t first, span, tol;
     
-    // +IPD (datos entrantes de conexión)
-    if (rx_line[0] == '+' && rx_pos >= 4 && 
-        rx_line[1] == 'I' && rx_line[2] == 'P' && rx_line[3] == 'D') return 1;
+    uart_send_string("AT\r\n");
+    if (!ay_uart_measure(idle)) return 0;
     
-    // Mensajes de conexión TCP/IP
-    if (rx_pos >= 4 && rx_line[0] == 'C' && rx_line[1] == 'O' && 
-        rx_line[2] == 'N' && rx_line[3] == 'N') return 1;  // CONNECT, CONNECTED
-    if (rx_pos >= 4 && rx_line[0] == 'C' && rx_line[1] == 'L' && 
-        rx_line[2] == 'O' && rx_line[3] == 'S') return 1;  // CLOSED
+    first = ay_uart_edges[0];
+    span = ay_uart_edges[4] - first;
+    tol = span / 16 + 2;
     
-    // Mensajes WiFi asíncronos
-    if (rx_pos >= 4 && rx_line[0] == 'W' && rx_line[1] == 'I' && 
-        rx_line[2] == 'F' && rx_line[3] == 'I') return 1;  // WIFI CONNECTED, WIFI GOT IP
+    if (diff16(ay_uart_edges[1] - first, span / 8) > tol) return 0;
+    if (diff16(ay_uart_edges[2] - first, span / 4) > tol) return 0;
+    if (diff16(ay_uart_edges[3] - first, span / 2) > tol) return 0;
     
-    // Mensajes de servidor propietarios
-    if (rx_pos >= 4 && rx_line[0] == 'L' && rx_line[1] == 'A' && 
-        rx_line[2] == 'I' && rx_line[3] == 'N') return 1;
-    if (rx_pos >= 4 && rx_line[0] == 'W' && rx_line[1] == 'F' && 
-        rx_line[2] == 'X' && rx_line[3] == 'R') return 1;
+    return span * UART_MEAS_POLL_T + 4 * UART_MEAS_EDGE_T;
+}
+
+// Ajusta cpu_clock a la máquina real midiendo las respuestas del ESP.
+// El reloj resultante es relativo al del ESP, así que también corrige
+// su desviación. Sin medidas válidas se queda en 3.5 MHz
+static void uart_calibrate(void)
+{
+    uint8_t c, i, good;
+    uint16_t t8;
+    uint32_t sum;
     
-    // Números solos (IDs de conexión o basura) - 1 o 2 dígitos solos
-    if (rx_pos <= 2 && rx_line[0] >= '0' && rx_line[0] <= '9') {
-        if (rx_pos == 1) return 1;
-        if (rx_pos == 2 && rx_line[1] >= '0' && rx_line[1] <= '9') return 1;
+    for (c = 0; c < sizeof(cpu_clock_mul); c++) {
+        cpu_clock = CPU_CLOCK_48K * cpu_clock_mul[c];
+        uart_set_baud(uart_baud);
+        
+        // Sin eco, la respuesta a "AT" empieza por '\r'
+        uart_send_string("ATE0\r\n");
+        uart_flush_hard();
+        
+        sum = 0;
+        good = 0;
+        for (i = 0; i < UART_CAL_TRIES; i++) {
+            t8 = uart_measure_cr(UART_CAL_IDLE * cpu_clock_mul[c]);
+            if (t8) { sum += t8; good++; }
+            uart_flush_hard();
+        }
+        
+        if (good >= 2) {
+            cpu_clock = (sum / good) * uart_baud / 8;
+            uart_set_baud(uart_baud);
+            return;
+        }
     }
     
-    // "busy" messages
-    if (rx_pos >= 4 && rx_line[0] == 'b' && rx_line[1] == 'u' && 
-        rx_line[2] == 's' && rx_line[3] == 'y') return 1;
+    cpu_clock = CPU_CLOCK_48K;
+    uart_set_baud(uart_baud);
+}
+
+// ============================================================
+// LINE CLASSIFIER (por bytes, mientras se busca el fin de línea)
+// ============================================================
+
+// Prefijos conocidos. Un prefijo más largo gana a uno más corto ("+IPD"
+// frente a "+"). LA TABLA VA EN ORDEN ASCII: el clasificador la recorre
+// como un trie aplanado y nunca vuelve atrás, así que cada byte cuesta lo
+// mismo aunque se añadan prefijos
+#define LC_EXACT 0x80   // El prefijo tiene que ser la línea entera
+
+typedef struct {
+    const char *text;
+    uint8_t cls;
+} line_prefix;
+
+static const line_prefix line_prefixes[] = {
+    { "\"",     LINE_DATA },        // Strings entrecomillados
+    { "(",      LINE_DATA },        // Respuestas de scan WiFi
+    { "+",      LINE_DATA },        // Respuestas AT+ estructuradas
+    { "+IPD",   LINE_EVENT },       // Datos entrantes de conexión
+    { "AT",     LINE_DATA },        // Echo / "AT version:"
+    { "CLOS",   LINE_EVENT },       // CLOSED
+    { "CONN",   LINE_EVENT },       // CONNECT, CONNECTED
+    { "ERROR",  LINE_ERROR },
+    { "FAIL",   LINE_ERROR },
+    { "LAIN",   LINE_EVENT },       // Mensajes de servidor propietarios
+    { "OK",     LINE_OK | LC_EXACT },
+    { "Recv",   LINE_DATA },        // Recv X bytes
+    { "SDK",    LINE_DATA },        // Versión SDK
+    { "SEND",   LINE_DATA },        // SEND OK, SEND FAIL
+    { "WFXR",   LINE_EVENT },
+    { "WIFI",   LINE_EVENT },       // WIFI CONNECTED, WIFI GOT IP
+    { "busy",   LINE_EVENT },
+    { "comp",   LINE_DATA },        // Versión de compilación
+    { "no ",    LINE_DATA },        // "no change"
+    { "ready",  LINE_EVENT },       // Tras reset
+};
+#define LINE_PREFIXES (sizeof(line_prefixes) / sizeof(line_prefixes[0]))
+
+static uint8_t lc_len;      // Caracteres imprimibles vistos
+static uint8_t lc_cand;     // Entrada de la tabla que sigue casando
+static uint8_t lc_depth;    // Caracteres casados con ella (< lc_len: ninguna)
+static uint8_t lc_class;    // Prefijo completo más largo hasta ahora
+static uint8_t lc_match;    // Su longitud
+static uint8_t lc_first;    // Primer carácter
+static uint8_t lc_dots;
+static uint8_t lc_colons;
+static uint8_t lc_digits;   // Todos los caracteres son dígitos
+
+// Procesa el byte 'pos' de la línea en curso
+static void line_class_feed(uint8_t c, uint16_t pos)
+{
+    const char *t;
+    
+    if (pos == 0) {
+        lc_len = 0;
+        lc_cand = 0;
+        lc_depth = 0;
+        lc_class = LINE_UNKNOWN;
+        lc_dots = lc_colons = 0;
+        lc_digits = 1;
+    }
     
-    // "ready" del ESP (tras reset)
-    if (rx_pos >= 5 && rx_line[0] == 'r' && rx_line[1] == 'e' && 
-        rx_line[2] == 'a' && rx_line[3] == 'd' && rx_line[4] == 'y') return 1;
+    // Lo que no es imprimible no se muestra ni cuenta
+    if (c < 32 || c >= 127) {
+        rx_stats.binary_bytes++;
+        return;
+    }
     
-    // "SEND OK" / "SEND FAIL" - pero solo si no esperamos respuesta de envío
-    // Lo dejamos pasar porque puede ser útil
+    if (lc_len == 0) lc_first = c;
+    if (c == '.') lc_dots++;
+    else if (c == ':') lc_colons++;
+    if (c < '0' || c > '9') lc_digits = 0;
+    
+    // Avanzar por la tabla solo mientras la entrada siguiente comparta lo
+    // ya casado. Las entradas ya completas (t[depth] == 0) se saltan. Si
+    // nada casa, lc_depth se queda atrás y la tabla no se vuelve a mirar
+    if (lc_depth == lc_len) {
+        while (1) {
+            t = line_prefixes[lc_cand].text;
+            if (t[lc_depth] == c) {
+                lc_depth++;
+                if (t[lc_depth] == 0) {
+                    lc_class = line_prefixes[lc_cand].cls;
+                    lc_match = lc_depth;
+                }
+                break;
+            }
+            if (t[lc_depth] > c || lc_cand + 1 >= LINE_PREFIXES ||
+                strncmp(t, line_prefixes[lc_cand + 1].text, lc_depth) != 0) break;
+            lc_cand++;
+        }
+    }
     
-    return 0;
+    if (lc_len < 255) lc_len++;
 }
 
-static uint8_t is_valid_response(void)
+// Clase de la línea completa cuando llega su CR/LF
+static uint8_t line_class_end(void)
 {
-    if (rx_pos == 0) return 0;
+    if (lc_len == 0) return LINE_UNKNOWN;
     
-    // PRIMERO: Filtrar ruido conocido
-    if (is_async_noise()) return 0;
+    if (lc_class != LINE_UNKNOWN) {
+        if (!(lc_class & LC_EXACT)) return lc_class;
+        if (lc_match == lc_len) return lc_class & ~LC_EXACT;
+    }
     
-    // Respuestas AT+ (comandos con respuesta estructurada)
-    if (rx_line[0] == '+') return 1;
+    // Números solos (IDs de conexión o basura) - 1 o 2 dígitos
+    if (lc_digits && lc_len <= 2) return LINE_NOISE;
     
-    // Strings entrecomillados (datos)
-    if (rx_line[0] == '"') return 1;
+    // Direcciones IP (x.x.x.x) y MAC (varios ':')
+    if (lc_first >= '0' && lc_first <= '9' && lc_dots >= 3) return LINE_DATA;
+    if (lc_len >= 17 && lc_colons >= 5) return LINE_DATA;
     
-    // Echo de comandos AT (si echo está habilitado)
-    if (rx_pos >= 2 && rx_line[0] == 'A' && rx_line[1] == 'T') return 1;
+    return LINE_UNKNOWN;
+}
+
+// ============================================================
+// LINE TOKENIZER (en el propio ring buffer, sin copias)
+// ============================================================
+
+// Una línea recibida, vista en su sitio dentro del ring buffer. Puede
+// cruzar el final del array: se accede siempre con SPAN_AT
+typedef struct {
+    uint16_t off;   // Índice de su primer byte en ring_buffer
+    uint8_t len;    // Sin el CR/LF
+    uint8_t cls;    // LINE_*
+} rx_span;
+
+#define SPAN_MAX 255
+#define SPAN_AT(sp, i) ring_buffer[((sp)->off + (i)) & RB_MASK]
+
+// <len> de "+IPD,...,<len>" justo antes del ':' en la posición 'colon'
+static uint16_t rx_ipd_len(uint8_t colon)
+{
+    uint16_t len = 0, mul = 1;
+    uint8_t c;
     
-    // Versión SDK
-    if (rx_pos >= 3 && rx_line[0] == 'S' && rx_line[1] == 'D' && rx_line[2] == 'K') return 1;
+    while (colon--) {
+        c = ring_buffer[(rb_tail + colon) & RB_MASK];
+        if (c < '0' || c > '9') break;
+        len += (c - '0') * mul;
+        mul *= 10;
+    }
+    return len;
+}
+
+// Busca la siguiente línea completa en lo que ya hay en RAM. Cada byte se
+// revisa una sola vez aunque la línea llegue a trozos entre llamadas. La
+// línea sigue ocupando el buffer hasta rx_release(), así que el driver no
+// puede pisarla.
+// "+IPD,<len>:" se corta en el ':' y se devuelve como cabecera: los <len>
+// bytes siguientes son carga binaria, no líneas, y mientras no se lean con
+// rx_read_payload() aquí no sale nada más
+static uint8_t rx_scan_line(rx_span *sp)
+{
+    uint8_t c;
     
-    // Versión de compilación
-    if (rx_pos >= 4 && rx_line[0] == 'c' && rx_line[1] == 'o' && 
-        rx_line[2] == 'm' && rx_line[3] == 'p') return 1;
+    if (rx_ipd_left) return 0;
     
-    // Direcciones IP (formato x.x.x.x con al menos 3 puntos)
-    if (rx_line[0] >= '0' && rx_line[0] <= '9') {
-        uint8_t i, dots = 0;
-        for (i = 0; i < rx_pos; i++) if (rx_line[i] == '.') dots++;
-        if (dots >= 3) return 1;
+    // Saltar CR/LF sueltos (líneas vacías y el terminador anterior)
+    while (rb_line_len == 0 && rb_tail != rb_head) {
+        c = ring_buffer[rb_tail];
+        if (c != 13 && c != 10) break;
+        rb_tail = (rb_tail + 1) & RB_MASK;
     }
     
-    // MAC addresses (contienen varios ':')
-    if (rx_pos >= 17) {
-        uint8_t i, colons = 0;
-        for (i = 0; i < rx_pos; i++) if (rx_line[i] == ':') colons++;
-        if (colons >= 5) return 1;
+    while (((rb_tail + rb_line_len) & RB_MASK) != rb_head) {
+        c = ring_buffer[(rb_tail + rb_line_len) & RB_MASK];
+        // Una línea sin fin no puede bloquear el buffer: se corta en SPAN_MAX
+        if (c == 13 || c == 10 || rb_line_len == SPAN_MAX) {
+            if (rb_line_len == SPAN_MAX) rx_stats.long_lines++;
+            sp->off = rb_tail;
+            sp->len = rb_line_len;
+            sp->cls = line_class_end();
+            return 1;
+        }
+        line_class_feed(c, rb_line_len);
+        rb_line_len++;
+        
+        // El único prefijo de evento que empieza por '+' es "+IPD"
+        if (c == ':' && rb_line_len > 5 && lc_first == '+' && lc_class == LINE_EVENT) {
+            rx_ipd_left = rx_ipd_len(rb_line_len - 1);
+            sp->off = rb_tail;
+            sp->len = rb_line_len;
+            sp->cls = line_class_end();
+            return 1;
+        }
     }
+    return 0;
+}
+
+// Drena el UART dentro de una espera activa
+static void rx_fill(void)
+{
+    uint16_t head = rb_head;
     
-    // Respuestas de scan WiFi (empiezan con "(")
-    if (rx_line[0] == '(') return 1;
-    
-    // SEND OK, SEND FAIL
-    if (rx_pos >= 4 && rx_line[0] == 'S' && rx_line[1] == 'E' && 
-        rx_line[2] == 'N' && rx_line[3] == 'D') return 1;
-    
-    // Recv X bytes
-    if (rx_pos >= 4 && rx_line[0] == 'R' && rx_line[1] == 'e' && 
-        rx_line[2] == 'c' && rx_line[3] == 'v') return 1;
+    uart_drain_to_buffer();
     
-    // "no change" response
-    if (rx_pos >= 6 && rx_line[0] == 'n' && rx_line[1] == 'o' && rx_line[2] == ' ') return 1;
+    // Con control de flujo el ESP espera con CTS arriba: si no llegó nada
+    // se cede el resto del frame. Si no, casi todo el tiempo pasaría en el
+    // DI del driver y FRAMES se saltaría interrupciones
+    if (uart_flow && head == rb_head) {
+        __asm__("ei");
+        __asm__("halt");
+    }
+}
+
+// Siguiente línea, drenando el UART si no hay ninguna completa
+static uint8_t rx_next_line(rx_span *sp)
+{
+    if (rx_scan_line(sp)) return 1;
+    rx_fill();
+    return rx_scan_line(sp);
+}
+
+// Devuelve al buffer el hueco de la línea ya procesada
+static void rx_release(const rx_span *sp)
+{
+    rb_tail = (sp->off + sp->len) & RB_MASK;
+    rb_line_len = 0;
+}
+
+// Copia a 'dst' (NULL: la tira) hasta 'max' bytes ya recibidos de la carga
+// del último +IPD, tal cual. Al completarla vuelve el modo línea.
+// Devuelve cuántos bytes ha sacado
+static uint16_t rx_read_payload(uint8_t *dst, uint16_t max)
+{
+    uint16_t n = 0;
+    int16_t c;
     
+    while (n < max && rx_ipd_left && (c = rb_pop()) != -1) {
+        if (dst) dst[n] = (uint8_t)c;
+        n++;
+    }
+    return n;
+}
+
+// Posición justo detrás de la primera aparición de 'needle', 0 si no está
+static uint8_t span_find(const rx_span *sp, const char *needle)
+{
+    uint8_t i, j;
+    for (i = 0; i < sp->len; i++) {
+        for (j = 0; needle[j] && i + j < sp->len && SPAN_AT(sp, i + j) == needle[j]; j++) ;
+        if (!needle[j]) return i + j;
+    }
     return 0;
 }
 
-static void show_rx_line(void)
+// Copia a 'dst' el campo 'n' (0 = primero) de una lista separada por comas
+// que empieza en 'from', p.ej. tras "+CWJAP:" en "ssid","bssid",6,-60.
+// Quita las comillas; las comas entre comillas no separan.
+// Devuelve la longitud copiada o -1 si la línea no tiene ese campo
+static int8_t span_field(const rx_span *sp, uint8_t from, uint8_t n, char *dst, uint8_t size)
 {
-    uint8_t i;
-    current_attr = ATTR_RESPONSE;
-    for (i = 0; i < rx_pos; i++) main_putchar(rx_line[i]);
+    uint8_t i, j = 0, quoted = 0;
+    char c;
+    
+    for (i = from; i < sp->len; i++) {
+        c = SPAN_AT(sp, i);
+        if (c == '"') { quoted = !quoted; continue; }
+        if (c == ',' && !quoted) {
+            if (n == 0) break;
+            n--;
+            continue;
+        }
+        if (n == 0 && j < size - 1) dst[j++] = c;
+    }
+    if (n) return -1;
+    dst[j] = 0;
+    return j;
+}
+
+// Campo numérico con signo (0 si falta o no es un número)
+static int16_t span_int(const rx_span *sp, uint8_t from, uint8_t n)
+{
+    char buf[8];
+    char *p = buf;
+    int16_t val = 0;
+    uint8_t neg = 0;
+    
+    if (span_field(sp, from, n, buf, sizeof(buf)) <= 0) return 0;
+    while (*p == ' ') p++;
+    if (*p == '-') { neg = 1; p++; }
+    while (*p >= '0' && *p <= '9') val = val * 10 + (*p++ - '0');
+    return neg ? -val : val;
+}
+
+static void print_span(const rx_span *sp, uint8_t max)
+{
+    uint8_t i, c;
+    for (i = 0; i < sp->len && i < max; i++) {
+        c = SPAN_AT(sp, i);
+        if (c >= 32 && c < 127) main_putchar(c);
+    }
     main_newline();
 }
 
-static void debug_show_line(const char *prefix)
+static void debug_show_span(const char *prefix, const rx_span *sp)
 {
-    uint8_t i;
     if (!debug_mode) return;
     current_attr = ATTR_DEBUG;
     main_puts(prefix);
-    for (i = 0; i < rx_pos && i < 50; i++) main_putchar(rx_line[i]);
-    main_newline();
+    print_span(sp, 50);
 }
 
-static uint8_t try_read_line(void)
+// Lo que haya llegado de la carga de un +IPD, en la zona principal
+static void show_payload(void)
 {
-    int16_t val;
-    uint8_t c;
+    uint8_t buf[32];
+    uint8_t i, n;
     
-    // 1. PRIMERO: Drenar hardware a RAM
-    // Esto es lo más importante. Aseguramos los datos antes de procesar.
-    uart_drain_to_buffer();
-
-    // 2. LUEGO: Procesar desde RAM
-    // Intentamos montar la línea con lo que hay en el buffer
-    while ((val = rb_pop()) != -1) {
-        c = (uint8_t)val;
-        
-        if (c == 13 || c == 10) {
-            // Si encontramos salto de línea y tenemos texto
-            if (rx_pos > 0) { 
-                rx_line[rx_pos] = 0; 
-                return 1; // ¡Línea completa encontrada!
-            }
-            continue; // Ignorar líneas vacías iniciales
-        }
-        
-        if (c >= 32 && c < 127 && rx_pos < RX_LINE_SIZE - 1) {
-            rx_line[rx_pos++] = c;
+    current_attr = ATTR_RESPONSE;
+    while ((n = rx_read_payload(buf, sizeof(buf))) != 0) {
+        for (i = 0; i < n; i++) {
+            if (buf[i] == 10) main_newline();
+            else if (buf[i] >= 32 && buf[i] < 127) main_putchar(buf[i]);
         }
     }
-    
-    return 0; // Aún no hay línea completa
 }
 
-static uint8_t wait_at_response(void)
+// ============================================================
+// ESP EVENTS
+// ============================================================
+
+static uint8_t status_pending = 0; // Un evento pide volver a consultar IP y red
+static uint16_t recv_pending = 0;   // Bytes avisados que aún tiene el ESP (!RECV P)
+
+// Mensajes que el ESP manda por su cuenta: cambian la barra de estado al
+// momento. La IP y el SSID se piden después, solo si hacen falta.
+// Llegan aquí desde at_poll(), at_sync() e idle_events(), así que ningún
+// aviso se pierde por llegar en mitad de otro comando
+static void esp_event(const rx_span *sp)
 {
-    uint32_t timeout = 0;     // Cambiado a 32 bits
-    uint32_t silence = 0;     // Cambiado a 32 bits
-    uint8_t terminator;
+    // Modo pasivo: "+IPD,<len>" sin ':' solo avisa, se pide con
+    // recv_pull(). Con ':' la carga va detrás y sale por show_payload()
+    if (span_find(sp, "+IPD,") == 5) {
+        if (!rx_ipd_left) recv_pending += span_int(sp, 5, 0);
+        return;
+    }
     
-    rx_pos = 0;
-    while (timeout < TIMEOUT_STD) { // Usamos la nueva constante grande
-        if (try_read_line()) {
-            silence = 0;
-            terminator = is_terminator();
-            if (terminator) { show_rx_line(); return terminator; }
-            if (is_valid_response()) show_rx_line();
-            rx_pos = 0;
-        } else {
-            silence++;
-            // Aumentamos el umbral de silencio para no cortar respuestas lentas
-            if (silence > 200000UL) break; 
-        }
-        
-        // Pequeño delay artificial para no saturar 100% CPU en bucles vacíos
-        // y dar tiempo al hardware UART a recibir bits
-        if ((timeout % 16) == 0) {
-             uart_drain_to_buffer(); // Drenamos activamente mientras esperamos
-        }
-        
-        timeout++;
+    if (span_find(sp, "WIFI GOT IP")) {
+        connection_status = 2;
+        status_pending = 1;
+    } else if (span_find(sp, "WIFI CONNECTED")) {
+        connection_status = 2;
+    } else if (span_find(sp, "WIFI DISCONNECT")) {
+        strcpy(device_ip, "---");
+        strcpy(device_ssid, "---");
+        device_rssi = 0;
+        connection_status = 0;
+        status_pending = 0;
+    } else {
+        return;
     }
-    return RESP_TIMEOUT;
+    draw_status_bar();
 }
 
 // ============================================================
-// SMART INIT - Reuses existing connection
+// AT TRANSACTIONS
 // ============================================================
 
-static uint8_t probe_esp(void)
+// Respuesta esperada: si una línea contiene 'prefix' se llama a 'parse'
+// con la posición justo detrás. Devuelve 1 si ya tiene lo que buscaba
+typedef struct {
+    const char *prefix;
+    uint8_t (*parse)(const rx_span *sp, uint8_t from);
+} at_handler;
+
+// Terminadores: un bit por clase de línea (1 << LINE_OK / LINE_ERROR)
+#define AT_END_OK    (1 << LINE_OK)
+#define AT_END_ERROR (1 << LINE_ERROR)
+#define AT_END       (AT_END_OK | AT_END_ERROR)
+#define AT_END_MATCH 0x08   // También termina un handler que devuelve 1
+#define AT_SHOW      0x10   // Mostrar respuestas y terminador
+#define AT_RENEW     0x20   // Cada línea renueva el plazo
+#define AT_NO_SYNC   0x40   // Sin at_sync() previo (detección del ESP)
+
+typedef struct {
+    const at_handler *handlers;
+    uint8_t n_handlers;
+    uint16_t timeout;   // TIMEOUT_*
+    uint8_t flags;      // AT_*
+} at_txn;
+
+static uint8_t at_lines; // Líneas recibidas en la última transacción
+
+// Consultas de sincronización: su respuesta no sale de ningún otro comando
+// del terminal. Se alternan para que la de una sync anterior que se quedó
+// sin leer no pase por la actual
+static const char * const sync_cmds[2] = { "AT+CIPMUX?\r\n", "AT+CWMODE?\r\n" };
+static const char * const sync_replies[2] = { "+CIPMUX:", "+CWMODE:" };
+static uint8_t sync_turn = 0;
+
+// Línea vieja que at_sync() no espera: los eventos del ESP se atienden
+// como en at_poll(), lo demás se tira
+static void sync_drop(const rx_span *sp)
 {
-    uint32_t timeout;
-    uint8_t tries;
-    uint8_t got_anything = 0;
-    uint32_t try_timeout;
-    
-    for (tries = 0; tries < 3; tries++) {
-        uart_flush_hard();
-        uart_send_string("AT\r\n");
-        rx_pos = 0;
-        timeout = 0;
-        got_anything = 0;
-        
-        // Primer intento más corto (ESP ya listo responde en <5ms)
-        // Siguientes intentos más largos por si está ocupado
-        try_timeout = (tries == 0) ? 8000UL : TIMEOUT_FAST;
-        
-        while (timeout < try_timeout) {
-            if (try_read_line()) {
-                got_anything = 1;
-                
-                if (debug_mode) {
-                    current_attr = ATTR_DEBUG;
-                    main_puts("[");
-                    main_puts(rx_line);
-                    main_puts("]");
-                    main_newline();
-                }
-                
-                if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') return 1;
-                rx_pos = 0;
-            }
-            timeout++;
+    if (sp->cls == LINE_EVENT) {
+        rx_stats.noise_lines++;
+        debug_show_span("~", sp);
+        esp_event(sp);
+    } else {
+        rx_stats.flushed += sp->len;
+        debug_show_span("-", sp);
+    }
+}
+
+// Deja la línea limpia antes de un comando: manda la consulta de sync y
+// tira todo lo que llegue hasta su respuesta y su OK. Así lo viejo se
+// descarta en cuanto se ve, sin esperar frames a ciegas.
+// Devuelve 0 si el ESP no contestó
+static uint8_t at_sync(void)
+{
+    rx_span sp;
+    uint16_t deadline;
+    uint8_t seen = 0, done = 0;
+    
+    // Las líneas ya completas pueden traer un WIFI... y los datos de un
+    // +IPD se muestran como en reposo. Solo se tira una línea incompleta:
+    // a mitad de una carga el buffer ya está vacío y rx_ipd_left sigue
+    show_payload();
+    while (rx_scan_line(&sp)) {
+        sync_drop(&sp);
+        rx_release(&sp);
+        show_payload();
+    }
+    if (!rx_ipd_left) rb_discard();
+    sync_turn ^= 1;
+    uart_send_string(sync_cmds[sync_turn]);
+    
+    deadline = deadline_in(TIMEOUT_PROBE);
+    while (!done && !deadline_passed(deadline)) {
+        if (!rx_next_line(&sp)) {
+            show_payload();
+            continue;
         }
         
-        // Show retry indicator only in debug
-        if (debug_mode) {
-            current_attr = ATTR_LOCAL;
-            if (got_anything) main_puts("(no OK)");
-            else main_puts("(silent)");
-        }
+        // Mientras llegue algo (restos de un comando largo) se sigue esperando
+        deadline = deadline_in(TIMEOUT_PROBE);
+        if (span_find(&sp, sync_replies[sync_turn])) seen = 1;
+        else if (seen && (sp.cls == LINE_OK || sp.cls == LINE_ERROR)) done = 1;
+        else sync_drop(&sp);
+        rx_release(&sp);
     }
-    
-    return 0;
+    return done;
 }
 
-static uint8_t check_has_ip(void)
+// Comandos pendientes de un pipeline (at_pipeline)
+static const char * const *at_queue;
+static uint8_t at_queued = 0;
+
+static const at_txn *at_open;   // Transacción en curso
+static uint16_t at_deadline;
+
+// Envía 'cmd' (NULL si ya se envió) y abre la transacción 't'. Todos los
+// comandos pasan por aquí
+static void at_begin(const char *cmd, const at_txn *t)
 {
-    uint32_t timeout;
-    uint8_t i, j;
-    char buf[16];
-    uint8_t found = 0;
-    
-    uart_flush_hard();
-    uart_send_string("AT+CIFSR\r\n");
-    rx_pos = 0;
-    timeout = 0;
-    
-    while (timeout < TIMEOUT_FAST && !found) {  
-        if (try_read_line()) {
-            // Debug output
-            if (debug_mode) {
-                current_attr = ATTR_DEBUG;
-                main_puts("CIFSR:");
-                main_puts(rx_line);
-                main_newline();
-            }
-            
-            // Skip async noise
-            if (rx_line[0] >= '0' && rx_line[0] <= '9') { rx_pos = 0; continue; }
-            if (rx_pos >= 4 && rx_line[0] == '+' && rx_line[1] == 'I' && 
-                rx_line[2] == 'P' && rx_line[3] == 'D') { rx_pos = 0; continue; }
-            if (rx_pos >= 4 && rx_line[0] == 'C' && rx_line[1] == 'O' && 
-                rx_line[2] == 'N' && rx_line[3] == 'N') { rx_pos = 0; continue; }
-            if (rx_pos >= 4 && rx_line[0] == 'C' && rx_line[1] == 'L' && 
-                rx_line[2] == 'O' && rx_line[3] == 'S') { rx_pos = 0; continue; }
-            if (rx_pos >= 4 && rx_line[0] == 'L' && rx_line[1] == 'A' && 
-                rx_line[2] == 'I' && rx_line[3] == 'N') { rx_pos = 0; continue; }
-            if (rx_pos >= 4 && rx_line[0] == 'W' && rx_line[1] == 'F' && 
-                rx_line[2] == 'X' && rx_line[3] == 'R') { rx_pos = 0; continue; }
-            
-            // Look for +CIFSR:STAIP,"x.x.x.x"
-            if (rx_pos > 10 && rx_line[0] == '+' && rx_line[1] == 'C' &&
-                rx_line[2] == 'I' && rx_line[3] == 'F' && rx_line[4] == 'S' &&
-                rx_line[5] == 'R' && rx_line[6] == ':') {
-                
-                for (i = 7; i < rx_pos - 4; i++) {
-                    if (rx_line[i] == 'S' && rx_line[i+1] == 'T' && 
-                        rx_line[i+2] == 'A' && rx_line[i+3] == 'I') {
-                        while (i < rx_pos && rx_line[i] != '"') i++;
-                        i++;
-                        j = 0;
-                        while (i < rx_pos && rx_line[i] != '"' && j < 15) {
-                            buf[j++] = rx_line[i++];
-                        }
-                        buf[j] = 0;
-                        
-                        if (j >= 7 && buf[0] != '0') {
-                            strcpy(device_ip, buf);
-                            found = 1;
-                        }
-                        break;
-                    }
-                }
-            }
-            
-            if (rx_pos == 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            rx_pos = 0;
+    if (cmd) {
+        // Lo que quede pendiente no es de este comando
+        if (t->flags & AT_NO_SYNC) {
+            uart_flush_rx();
+            rb_discard();
+        } else {
+            at_sync();
         }
-        timeout++;
+        uart_send_string(cmd);
     }
     
-    uart_flush_rx();
-    return found;
+    at_open = t;
+    at_lines = 0;
+    at_deadline = deadline_in(t->timeout);
 }
 
-static void get_ssid_rssi(void)
+// Atiende las líneas que ya están en el buffer, sin esperar al UART. Hasta
+// un terminador de t->flags o el plazo devuelve RESP_WAITING; después
+// RESP_GOT_OK, RESP_GOT_ERROR, RESP_GOT_MATCH o RESP_TIMEOUT
+static uint8_t at_poll(void)
 {
-    uint32_t timeout;
-    uint8_t i, j;
-    char buf[32];
-    uint8_t found_line = 0;
-    
-    uart_flush_hard();
-    uart_send_string("AT+CWJAP?\r\n");
-    
-    rx_pos = 0;
-    timeout = 0;
-    
-    while (timeout < TIMEOUT_FAST) {
-        if (try_read_line()) {
-            
-            if (rx_pos < 5) { rx_pos = 0; continue; }
-            
-            // Debug: ver qué llega
-            if (debug_mode) {
-                current_attr = ATTR_DEBUG;
-                main_puts("RX:"); main_puts(rx_line); main_newline();
-            }
-
-            // Buscar "+CWJAP:"
-            for (i = 0; i < rx_pos - 6; i++) {
-                if (rx_line[i] == '+' && rx_line[i+1] == 'C' && rx_line[i+2] == 'W' && rx_line[i+3] == 'J') {
-                    
-                    found_line = 1;
-                    
-                    // --- 1. LEER SSID ---
-                    while (i < rx_pos && rx_line[i] != '"') i++;
-                    i++; // saltar comilla inicio
-                    
-                    j = 0;
-                    while (i < rx_pos && rx_line[i] != '"' && j < 19) {
-                        buf[j++] = rx_line[i++];
-                    }
-                    buf[j] = 0;
-                    if (j > 0) strcpy(device_ssid, buf);
-                    
-                    // --- 2. LEER RSSI (Buscando la 3ª coma) ---
-                    // Formato: +CWJAP:"ssid","bssid",channel,rssi
-                    
-                    uint8_t commas = 0;
-                    while (i < rx_pos) {
-                        if (rx_line[i] == ',') {
-                            commas++;
-                            // Queremos lo que hay DESPUÉS de la 3ª coma
-                            // (Nota: como 'i' ya pasó el SSID, esta será la 1ª coma que veamos en el bucle,
-                            // que corresponde a la coma tras el SSID. Necesitamos contar hasta llegar al RSSI).
-                            
-                            // Comas esperadas desde el inicio de la línea:
-                            // 1ª: tras SSID
-                            // 2ª: tras BSSID
-                            // 3ª: tras Channel -> AQUI viene el RSSI
-                            
-                            // Mi bucle empieza DESPUÉS del SSID. Así que veré:
-                            // Coma 1 (la que separa SSID de BSSID) -> commas=1
-                            // ... BSSID ...
-                            // Coma 2 (la que separa BSSID de Channel) -> commas=2
-                            // ... Channel ...
-                            // Coma 3 (la que separa Channel de RSSI) -> commas=3 -> LEER AHORA!
-                            
-                            if (commas == 3) {
-                                i++; // saltar la coma
-                                
-                                // Leer número (con signo)
-                                int16_t val = 0;
-                                int8_t sign = 1;
-                                
-                                // Saltar espacios si los hay
-                                while(i < rx_pos && rx_line[i] == ' ') i++;
-                                
-                                if (i < rx_pos && rx_line[i] == '-') {
-                                    sign = -1;
-                                    i++;
-                                }
-                                
-                                while (i < rx_pos && rx_line[i] >= '0' && rx_line[i] <= '9') {
-                                    val = val * 10 + (rx_line[i] - '0');
-                                    i++;
-                                }
-                                
-                                if (val != 0) {
-                                    device_rssi = (int8_t)(val * sign);
-                                }
-                                break; // Fin del while de comas
-                            }
-                        }
-                        i++;
-                    }
-                    break; // Fin del for principal
-                }
+    rx_span sp;
+    const at_txn *t = at_open;
+    const at_handler *h;
+    uint8_t i, from, result = RESP_WAITING;
+    
+    show_payload();
+    while (result == RESP_WAITING && rx_scan_line(&sp)) {
+        at_lines++;
+        if (t->flags & AT_RENEW) at_deadline = deadline_in(t->timeout);
+        
+        if (sp.cls == LINE_EVENT || sp.cls == LINE_NOISE) {
+            rx_stats.noise_lines++;
+            debug_show_span("~", &sp);
+            if (sp.cls == LINE_EVENT) esp_event(&sp);
+        } else if ((t->flags & AT_SHOW) && sp.cls != LINE_UNKNOWN) {
+            current_attr = ATTR_RESPONSE;
+            print_span(&sp, SPAN_MAX);
+        } else {
+            debug_show_span("RX:", &sp);
+        }
+        
+        for (i = 0, h = t->handlers; i < t->n_handlers; i++, h++) {
+            from = span_find(&sp, h->prefix);
+            if (from && h->parse(&sp, from) && (t->flags & AT_END_MATCH)) result = RESP_GOT_MATCH;
+        }
+        
+        // LINE_OK/LINE_ERROR valen lo mismo que RESP_GOT_OK/RESP_GOT_ERROR
+        if ((sp.cls == LINE_OK || sp.cls == LINE_ERROR) && (t->flags & (1 << sp.cls))) {
+            if (at_queued) {
+                // Pipeline: el siguiente comando sale en cuanto el ESP
+                // termina el anterior, sin flush ni pausas entre medias
+                uart_send_string(*at_queue++);
+                at_queued--;
+                at_deadline = deadline_in(t->timeout);
+            } else {
+                result = sp.cls;
             }
-            
-            if (found_line) break;
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            if (rx_pos >= 4 && rx_line[0] == 'F' && rx_line[1] == 'A') break;
-            rx_pos = 0;
         }
-        timeout++;
+        
+        rx_release(&sp);
+        show_payload();
     }
     
-    if (found_line) uart_flush_rx();
+    if (result == RESP_WAITING && deadline_passed(at_deadline)) result = RESP_TIMEOUT;
+    if (result != RESP_WAITING) at_queued = 0;
+    return result;
 }
 
-static void get_at_version(void)
+// at_begin() + at_poll() esperando en el sitio
+static uint8_t at_transact(const char *cmd, const at_txn *t)
 {
-    uint32_t timeout;
-    uint8_t i, j;
-    uint8_t found = 0;
+    uint8_t result;
     
-    uart_flush_hard();
-    uart_send_string("AT+GMR\r\n");
+    at_begin(cmd, t);
+    while ((result = at_poll()) == RESP_WAITING) rx_fill();
+    return result;
+}
+
+// Varias consultas independientes seguidas, con las respuestas repartidas
+// por prefijo entre los handlers de 't' y separadas por su terminador. El
+// ESP contesta "busy p..." a lo que llega mientras procesa un comando, así
+// que no se mandan todas de golpe: cada una sale al ver el OK anterior.
+// Devuelve el resultado de la última
+static uint8_t at_pipeline(const char * const *cmds, uint8_t n, const at_txn *t)
+{
+    at_queue = cmds + 1;
+    at_queued = n - 1;
+    return at_transact(cmds[0], t);
+}
+
+// Respuesta de un comando ya enviado, en pantalla
+static const at_txn at_wait = { 0, 0, TIMEOUT_STD, AT_END | AT_SHOW | AT_RENEW };
+
+// ============================================================
+// BACKGROUND JOB (comando en curso sin bloquear el teclado)
+// ============================================================
+
+// main() avanza la tarea una vez por frame y sigue atendiendo el teclado.
+// Al acabar se llama a 'done' con el resultado; puede encadenar otra tarea
+typedef void (*job_done_fn)(uint8_t result);
+
+#define JOB_IDLE  0
+#define JOB_AT    1   // Transacción abierta con at_begin()
+#define JOB_TIMER 2   // Pausa sin tráfico propio
+#define JOB_FILL  3   // Llenando el ring buffer sin procesar nada
+
+static uint8_t job_state = JOB_IDLE;
+static job_done_fn job_done;
+static uint16_t job_deadline;
+static uint32_t job_mark;
+static uint16_t job_bytes;
+
+static void job_start(const char *cmd, const at_txn *t, job_done_fn done)
+{
+    at_begin(cmd, t);
+    job_done = done;
+    job_state = JOB_AT;
+}
+
+// 'done' recibe RESP_TIMEOUT al cumplirse el plazo
+static void job_after(uint16_t ms, job_done_fn done)
+{
+    job_deadline = deadline_in(ms);
+    job_done = done;
+    job_state = JOB_TIMER;
+}
+
+// 'done' recibe RESP_GOT_OK cuando han entrado 'bytes' más en el ring
+// buffer, o RESP_TIMEOUT a los 'ms'. Hasta entonces no se lee ni se pinta
+// nada, así que entre frame y frame todo el tiempo es de muestreo
+static void job_fill(uint16_t bytes, uint16_t ms, job_done_fn done)
+{
+    job_mark = rx_stats.rx_bytes;
+    job_bytes = bytes;
+    job_deadline = deadline_in(ms);
+    job_done = done;
+    job_state = JOB_FILL;
+}
+
+static void job_poll(void)
+{
+    uint8_t result;
+    
+    if (job_state == JOB_AT) {
+        result = at_poll();
+        if (result == RESP_WAITING) return;
+    } else if (job_state == JOB_FILL) {
+        if (rx_stats.rx_bytes - job_mark >= job_bytes) {
+            result = RESP_GOT_OK;
+        } else {
+            if (!deadline_passed(job_deadline)) return;
+            result = RESP_TIMEOUT;
+        }
+    } else {
+        if (!deadline_passed(job_deadline)) return;
+        result = RESP_TIMEOUT;
+    }
     
-    rx_pos = 0;
-    timeout = 0;
+    job_state = JOB_IDLE;
+    if (job_done) job_done(result);
+}
+
+// BREAK: se deja de esperar. Lo que el ESP siga mandando de ese comando lo
+// tira idle_events() o el at_sync() del siguiente
+static void job_cancel(void)
+{
+    job_state = JOB_IDLE;
+    at_queued = 0;
+}
+
+static void job_report_timeout(uint8_t result)
+{
+    if (result != RESP_TIMEOUT) return;
+    current_attr = ATTR_LOCAL;
+    main_puts("[Timeout]");
+    main_newline();
+}
+
+// ============================================================
+// SMART INIT - Reuses existing connection
+// ============================================================
+
+static const at_txn probe_first = { 0, 0, TIMEOUT_PROBE, AT_END_OK | AT_NO_SYNC };
+static const at_txn probe_retry = { 0, 0, TIMEOUT_FAST, AT_END_OK | AT_NO_SYNC };
+
+static uint8_t probe_esp(void)
+{
+    uint8_t tries;
     
-    while (timeout < TIMEOUT_FAST) {
-        if (try_read_line()) {
-            
-            // Debug
-            if (debug_mode) {
-                current_attr = ATTR_DEBUG;
-                main_puts("GMR:"); main_puts(rx_line); main_newline();
-            }
-            
-            // Buscar "AT version:" en la línea
-            // Formato: "AT version:1.7.4.0(May..."
-            if (!found && rx_pos > 12) {
-                for (i = 0; i < rx_pos - 10; i++) {
-                    if (rx_line[i] == 'A' && rx_line[i+1] == 'T' && 
-                        rx_line[i+2] == ' ' && rx_line[i+3] == 'v') {
-                        // Encontrado "AT v", buscar ':'
-                        while (i < rx_pos && rx_line[i] != ':') i++;
-                        i++; // saltar ':'
-                        
-                        // Extraer versión (solo números y puntos hasta '(' o espacio)
-                        j = 0;
-                        while (i < rx_pos && j < 6) {
-                            char c = rx_line[i];
-                            if (c >= '0' && c <= '9') {
-                                device_at_ver[j++] = c;
-                            } else if (c == '.' && j > 0) {
-                                // Solo añadir punto si hay dígito antes y después
-                                if (i + 1 < rx_pos && rx_line[i+1] >= '0' && rx_line[i+1] <= '9') {
-                                    device_at_ver[j++] = c;
-                                } else {
-                                    break; // Punto final, parar
-                                }
-                            } else {
-                                break;
-                            }
-                            i++;
-                        }
-                        device_at_ver[j] = 0;
-                        found = 1;
-                        break;
-                    }
-                }
-            }
-            
-            // Esperar OK antes de salir
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            rx_pos = 0;
+    for (tries = 0; tries < 3; tries++) {
+        // Primer intento más corto (ESP ya listo responde en <5ms)
+        // Siguientes intentos más largos por si está ocupado
+        if (at_transact("AT\r\n", tries ? &probe_retry : &probe_first) == RESP_GOT_OK) return 1;
+        
+        // Show retry indicator only in debug
+        if (debug_mode) {
+            current_attr = ATTR_LOCAL;
+            main_puts(at_lines ? "(no OK)" : "(silent)");
         }
-        timeout++;
     }
     
-    uart_flush_hard(); // Limpieza agresiva al salir
+    return 0;
+}
+
+// +CIFSR:STAIP,"x.x.x.x" ("0.0.0.0" sin conexión)
+static uint8_t parse_cifsr_ip(const rx_span *sp, uint8_t from)
+{
+    char buf[16];
+    
+    if (span_field(sp, from, 0, buf, sizeof(buf)) < 7 || buf[0] == '0') return 0;
+    strcpy(device_ip, buf);
+    return 1;
+}
+
+
+// Formato: +CWJAP:"ssid","bssid",channel,rssi
+static uint8_t parse_cwjap(const rx_span *sp, uint8_t from)
+{
+    char buf[20];
+    int16_t rssi;
+    
+    if (span_field(sp, from, 0, buf, sizeof(buf)) > 0) strcpy(device_ssid, buf);
+    rssi = span_int(sp, from, 3);
+    if (rssi != 0) device_rssi = (int8_t)rssi;
+    return 1;
+}
+
+// Formato: "AT version:1.7.4.0(May..."
+static uint8_t parse_gmr(const rx_span *sp, uint8_t from)
+{
+    uint8_t i, j = 0;
+    char c;
+    
+    // Extraer versión (solo números y puntos hasta '(' o espacio)
+    for (i = from; i < sp->len && j < 6; i++) {
+        c = SPAN_AT(sp, i);
+        if (c >= '0' && c <= '9') {
+            device_at_ver[j++] = c;
+        } else if (c == '.' && j > 0 && i + 1 < sp->len &&
+                   SPAN_AT(sp, i + 1) >= '0' && SPAN_AT(sp, i + 1) <= '9') {
+            // Solo añadir punto si hay dígito antes y después
+            device_at_ver[j++] = c;
+        } else {
+            break;
+        }
+    }
+    device_at_ver[j] = 0;
+    return 1;
+}
+
+// Consultas de estado independientes entre sí. Van en un solo pipeline y
+// cada línea acaba en su handler por el prefijo
+static const char * const status_queries[] = { "AT+GMR\r\n", "AT+CIFSR\r\n", "AT+CWJAP?\r\n" };
+
+static const at_handler status_handlers[] = {
+    { "AT version:", parse_gmr },
+    { "+CIFSR:STAIP,", parse_cifsr_ip },
+    { "+CWJAP:", parse_cwjap },
+};
+static const at_txn status_txn = { status_handlers, 3, TIMEOUT_FAST, AT_END };
+
+// IP, SSID y RSSI (y versión AT con 'with_version'). Devuelve 1 si hay IP
+static uint8_t query_status(uint8_t with_version)
+{
+    status_pending = 0;
+    strcpy(device_ip, "---");
+    if (with_version) at_pipeline(status_queries, 3, &status_txn);
+    else at_pipeline(status_queries + 1, 2, &status_txn);
+    return device_ip[0] != '-';
 }
 
 static void uart_init(void)
@@ -1293,6 +1913,7 @@ static void uart_init(void)
     uint8_t i;
     
     ay_uart_init();
+    uart_set_baud(uart_baud);
     
     // Espera mínima para que el UART esté listo (reducido de 30 a 10)
     for (i = 0; i < 10; i++) {
@@ -1301,15 +1922,9 @@ static void uart_init(void)
     }
     
     uart_flush_rx();
-    uart_send_string("ATE0\r\n");
-    
-    // Espera respuesta ATE0 (reducido de 15 a 5)
-    for (i = 0; i < 5; i++) {
-        __asm__("ei");
-        __asm__("halt");
-    }
     
-    uart_flush_rx();
+    // Deja ATE0 puesto y el driver ajustado al reloj de esta máquina
+    uart_calibrate();
     
     // Disable multi-connection mode to reduce server noise
     uart_send_string("AT+CIPMUX=0\r\n");
@@ -1360,18 +1975,14 @@ static void smart_init(void)
     main_puts(" OK");
     main_newline();
     
-    // Obtener versión AT y verificar conexión en paralelo conceptual
-    // (se ejecutan secuencialmente pero sin delays extras)
-    get_at_version();
-    
     main_puts("Checking connection...");
     main_newline();
     
-    if (check_has_ip()) {
+    // Versión AT, IP y red en un solo pipeline
+    if (query_status(1)) {
         main_puts("Connected: ");
         main_puts(device_ip);
         main_newline();
-        get_ssid_rssi();
         connection_status = 1;
     } else {
         main_puts("No WiFi connection");
@@ -1381,52 +1992,243 @@ static void smart_init(void)
     draw_status_bar();
 }
 
+static void check_connection_done(uint8_t result)
+{
+    connection_status = (device_ip[0] != '-') ? 1 : 0;
+    draw_status_bar();
+}
+
+// IP, SSID y RSSI como tarea en segundo plano: el mismo pipeline que
+// query_status(0), pero el teclado sigue vivo mientras contesta el ESP
 static void check_connection(void)
 {
     connection_status = 2;
-    draw_status_bar();
     strcpy(device_ip, "---");
     strcpy(device_ssid, "---");
     device_rssi = 0;
+    draw_status_bar();
     
-    if (check_has_ip()) {
-        get_ssid_rssi();
-        connection_status = 1;
-    } else {
-        connection_status = 0;
+    status_pending = 0;
+    at_queue = status_queries + 2;
+    at_queued = 1;
+    job_start(status_queries[1], &status_txn, check_connection_done);
+}
+
+// ============================================================
+// PASSIVE RECEIVE (AT+CIPRECVMODE=1)
+// ============================================================
+
+// En modo pasivo el ESP se guarda los datos y solo avisa con "+IPD,<len>".
+// Se piden con AT+CIPRECVDATA en bloques que caben en el ring buffer, y la
+// respuesta no se pinta hasta tenerla entera: el ESP no manda nada que no
+// se le pida, así que no se pierde nada aunque no haya control de flujo
+
+#define RECV_SLACK 32   // Cabecera "+CIPRECVDATA,<n>:" y "OK" del bloque
+
+static uint8_t recv_passive = 0;
+
+static const at_txn recv_txn = { 0, 0, TIMEOUT_FAST, AT_END };
+static const at_txn recv_mode_txn = { 0, 0, TIMEOUT_FAST, AT_END | AT_SHOW };
+
+// Saca bytes del buffer hasta pasar 's'. Devuelve 0 si se acabó antes
+static uint8_t rb_skip_past(const char *s)
+{
+    uint8_t j = 0;
+    int16_t c;
+    
+    while (s[j]) {
+        if ((c = rb_pop()) == -1) return 0;
+        if (c == s[j]) j++;
+        else j = (c == s[0]) ? 1 : 0;
     }
-    draw_status_bar();
+    return 1;
+}
+
+// Bloque entero en el buffer: se pintan exactamente los bytes anunciados y
+// el "OK" final se consume como una transacción más
+static void recv_show(uint8_t result)
+{
+    uint16_t len = 0;
+    int16_t c;
+    
+    // "+CIPRECVDATA,<len>:" (AT 1.x) o "+CIPRECVDATA:<len>," (AT 2.x)
+    if (!rb_skip_past("+CIPRECVDATA") || rb_pop() == -1) {
+        recv_pending = 0;
+        return;
+    }
+    while ((c = rb_pop()) >= '0' && c <= '9') len = len * 10 + (c - '0');
+    
+    recv_pending = (len < recv_pending) ? recv_pending - len : 0;
+    
+    current_attr = ATTR_RESPONSE;
+    while (len-- && (c = rb_pop()) != -1) {
+        if (c == 10) main_newline();
+        else if (c >= 32 && c < 127) main_putchar((uint8_t)c);
+    }
+    
+    job_start(0, &recv_txn, 0);
+}
+
+// Pide el siguiente bloque. Solo con el buffer vacío y nada en curso
+static void recv_pull(void)
+{
+    char cmd[24];
+    uint16_t n, deadline;
+    
+    // El bloque tiene que caber sin dar la vuelta al array: en el wrap el
+    // driver vuelve a C entre dos bytes y sin control de flujo no llega a
+    // tiempo al siguiente bit de start. Vacío, se puede empezar por el 0
+    if (rx_ipd_left) return;
+    rb_discard();
+    n = rb_contig_free() - RECV_SLACK;
+    if (n > recv_pending) n = recv_pending;
+    
+    strcpy(cmd, "AT+CIPRECVDATA=");
+    u16_to_dec(cmd + 15, n);
+    strcat(cmd, "\r\n");
+    
+    job_fill(n + 20, TIMEOUT_FAST, recv_show);
+    uart_send_string(cmd);
+    
+    // La respuesta empieza en unos ms: se recoge aquí su primera ráfaga para
+    // no perder el principio si main() tarda en volver a idle_wait_frame()
+    deadline = deadline_in(TIMEOUT_PROBE);
+    while (rx_stats.rx_bytes == job_mark && !deadline_passed(deadline)) rx_fill();
+}
+
+static void cmd_recv(void)
+{
+    uint8_t i = 5;
+    
+    current_attr = ATTR_LOCAL;
+    
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (line_buffer[i] == 'P' || line_buffer[i] == 'p') {
+        if (at_transact("AT+CIPRECVMODE=1\r\n", &recv_mode_txn) == RESP_GOT_OK) recv_passive = 1;
+    } else if (line_buffer[i] == 'A' || line_buffer[i] == 'a') {
+        if (at_transact("AT+CIPRECVMODE=0\r\n", &recv_mode_txn) == RESP_GOT_OK) recv_passive = 0;
+        recv_pending = 0;
+    }
+    
+    current_attr = ATTR_LOCAL;
+    main_puts(recv_passive ? "Receive mode: passive" : "Receive mode: active");
+    main_newline();
 }
 
 // ============================================================
-// SEND AT COMMAND
+// IDLE (mensajes no solicitados del ESP)
 // ============================================================
 
-// Versión simplificada: solo envía los datos, no gestiona la UI
-static void execute_raw_at_command(const char *cmd)
+// Espera al siguiente frame atendiendo el UART, para que lo que el ESP
+// mande por su cuenta llegue al ring buffer en vez de perderse en el HALT.
+// Con control de flujo el ESP se lo guarda: basta un drenaje por frame
+static void idle_wait_frame(void)
 {
-    uint8_t i, result;
-    uint8_t len = strlen(cmd);
+    uint16_t frame;
     
-    uart_flush_rx();
-    for (i = 0; i < len; i++) ay_uart_send(cmd[i]);
-    ay_uart_send(13);
-    ay_uart_send(10);
+    if (uart_flow) {
+        __asm__("ei");
+        __asm__("halt");
+        uart_drain_to_buffer();
+        return;
+    }
     
-    result = wait_at_response();
+    frame = timer_frames();
+    __asm__("ei");
+    while (timer_frames() == frame) uart_drain_to_buffer();
+}
+
+// Líneas recibidas en reposo: los eventos actualizan la barra de estado y
+// se cuentan como ruido; lo demás (banners de servidor, datos de +IPD) se
+// muestra. Solo se pregunta al ESP si un evento lo pide
+static void idle_events(void)
+{
+    rx_span sp;
     
-    if (result == RESP_TIMEOUT) {
-        current_attr = ATTR_LOCAL;
-        main_puts("[Timeout]");
-        main_newline();
+    show_payload();
+    while (rx_scan_line(&sp)) {
+        if (sp.cls == LINE_EVENT) esp_event(&sp);
+        
+        if (sp.cls == LINE_NOISE || sp.cls == LINE_EVENT) {
+            debug_show_span("~", &sp);
+            rx_stats.noise_lines++;
+        } else {
+            current_attr = ATTR_RESPONSE;
+            print_span(&sp, SPAN_MAX);
+        }
+        rx_release(&sp);
+        show_payload();
+    }
+    
+    // Con una pausa de otro comando en curso se deja para una vuelta libre
+    if (status_pending && job_state == JOB_IDLE) check_connection();
+}
+
+// RSSI en segundo plano: un AT+CWJAP? cada RSSI_REFRESH ms mientras no
+// haya nada en curso, atendido frame a frame como cualquier tarea. Solo se
+// redibujan las barras, y solo si el valor cambia
+#define RSSI_REFRESH 40000
+
+static uint16_t rssi_due;
+static int8_t rssi_shown;
+
+static uint8_t parse_rssi(const rx_span *sp, uint8_t from)
+{
+    int16_t rssi = span_int(sp, from, 3);
+    
+    if (rssi != 0) device_rssi = (int8_t)rssi;
+    return 1;
+}
+
+static const at_handler rssi_handlers[] = { { "+CWJAP:", parse_rssi } };
+static const at_txn rssi_txn = { rssi_handlers, 1, TIMEOUT_FAST, AT_END };
+
+static void rssi_done(uint8_t result)
+{
+    rssi_due = deadline_in(RSSI_REFRESH);
+    if (device_rssi != rssi_shown) draw_signal_bars(STATUS_LINE, 24, device_rssi);
+}
+
+static void rssi_refresh(void)
+{
+    // Sin conexión el plazo se va corriendo: al conectar hay RSSI reciente
+    if (connection_status != 1) {
+        rssi_due = deadline_in(RSSI_REFRESH);
+        return;
     }
+    
+    // Sin at_sync(), que esperaría la respuesta del marcador: se envía
+    // solo con el buffer vacío, justo después de idle_events()
+    if (!deadline_passed(rssi_due) || rb_tail != rb_head) return;
+    
+    rssi_shown = device_rssi;
+    uart_send_string("AT+CWJAP?\r\n");
+    job_start(0, &rssi_txn, rssi_done);
+}
+
+// ============================================================
+// SEND AT COMMAND
+// ============================================================
+
+// Versión simplificada: solo envía los datos, la respuesta la muestra la
+// tarea en segundo plano. Sin at_sync(): tras un AT+CIPSEND tecleado el ESP
+// espera en su '>' y la consulta de sync acabaría dentro de los datos. Lo
+// que quede en el buffer ya lo mostró idle_events() o lo muestra at_wait
+static void execute_raw_at_command(const char *cmd)
+{
     uart_flush_rx();
+    uart_send_string(cmd);
+    uart_send_string("\r\n");
+    job_start(0, &at_wait, job_report_timeout);
 }
 
 // ============================================================
 // LOCAL COMMANDS
 // ============================================================
 
+// CAPS SHIFT + SPACE (bit 15 del scancode: con CAPS)
+#define KEY_BREAK (IN_KEY_SCANCODE_SPACE | 0x8000)
+
 static uint8_t cmd_match(const char *cmd)
 {
     uint8_t i = 0;
@@ -1444,429 +2246,1506 @@ static void cmd_cls(void) { clear_zone(MAIN_START, MAIN_LINES, ATTR_MAIN_BG); ma
 
 static void cmd_ip(void) { current_attr = ATTR_LOCAL; main_puts("Refreshing..."); main_newline(); check_connection(); }
 
+static const at_txn cwlap_txn = { 0, 0, TIMEOUT_LONG, AT_END | AT_SHOW };
+
 static void cmd_scan(void) 
 { 
     current_attr = ATTR_LOCAL; 
     main_puts("Scanning..."); 
     main_newline(); 
     
-    rb_flush(); // Usamos nuestra nueva función de limpieza total
-    uart_send_string("AT+CWLAP\r\n"); 
+    // Aunque tardemos en mostrar cada línea (scroll), los siguientes datos
+    // se acumulan en ring_buffer en cada frame
+    job_start("AT+CWLAP\r\n", &cwlap_txn, job_report_timeout);
+}
+
+static void cmd_info(void) { job_start("AT+GMR\r\n", &at_wait, 0); }
+
+static void cmd_debug(void) { debug_mode = !debug_mode; current_attr = ATTR_LOCAL; main_puts(debug_mode ? "Debug ON" : "Debug OFF"); main_newline(); }
+
+// Reloj local: tras una sincronización se cuentan los segundos desde
+// medianoche con FRAMES y la barra solo se redibuja al cambiar el minuto.
+// Los frames que se pierden con DI lo van retrasando, así que cada
+// CLOCK_RESYNC segundos se vuelve a leer la hora del ESP en segundo plano
+#define CLOCK_RESYNC 3600
+#define CLOCK_RETRY  60         // Reintento si la lectura falla
+
+static uint32_t clock_secs;     // Segundos desde medianoche
+static uint16_t clock_frame;    // Frame en que empezó el segundo actual
+static uint16_t clock_age;      // Segundos desde la última lectura
+static uint16_t clock_shown;    // Minuto del día que hay en pantalla
+static uint8_t clock_set = 0;
+static uint8_t sntp_ok;         // La última lectura trajo la hora
+
+static void clock_format(void)
+{
+    uint8_t h = (uint8_t)(clock_secs / 3600), m = (uint8_t)(clock_secs / 60 % 60);
+    
+    device_time[0] = '0' + h / 10;
+    device_time[1] = '0' + h % 10;
+    device_time[2] = ':';
+    device_time[3] = '0' + m / 10;
+    device_time[4] = '0' + m % 10;
+    device_time[5] = 0;
+    clock_shown = (uint16_t)(clock_secs / 60);
+}
+
+// Una vez por vuelta de main(): avanza los segundos que hayan pasado, de
+// una vez aunque venga de un comando largo
+static void clock_tick(void)
+{
+    uint16_t secs;
+    
+    if (!clock_set) return;
+    secs = (uint16_t)(timer_frames() - clock_frame) / 50;
+    if (!secs) return;
     
-    uint32_t timeout = 0;
-    rx_pos = 0;
+    clock_frame += secs * 50;
+    clock_secs = (clock_secs + secs) % 86400UL;
+    clock_age = (clock_age < 0xFFFF - secs) ? clock_age + secs : 0xFFFF;
     
-    // Bucle de espera largo
-    while (timeout < TIMEOUT_LONG) { 
-        
-        // try_read_line ahora se encarga de salvar los datos en RAM
-        if (try_read_line()) {
-            
-            // Si hay línea, la mostramos.
-            // AUNQUE tardemos mucho en mostrarla (scroll), 
-            // los siguientes datos se acumularán en ring_buffer 
-            // en la siguiente llamada a try_read_line/uart_drain.
-            if (is_valid_response() || is_terminator()) {
-                show_rx_line();
-            }
-            
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            if (rx_pos >= 5 && rx_line[0] == 'E' && rx_line[1] == 'R') break;
-            
-            rx_pos = 0;
-        }
-        
-        // TRUCO PRO: Si el Z80 está ocioso esperando, 
-        // forzamos drenaje constante para mantener el hardware vacío.
-        uart_drain_to_buffer();
-        
-        timeout++;
+    if (clock_secs / 60 != clock_shown) {
+        clock_format();
+        print_padded(STATUS_LINE, 54, device_time, ATTR_VAL, 5);
     }
+}
+
+// +CIPSNTPTIME:Thu Jan 01 00:00:00 1970  (not synced)
+// +CIPSNTPTIME:Fri Dec 27 21:45:30 2024  (synced)
+static uint8_t parse_sntp_time(const rx_span *sp, uint8_t from)
+{
+    uint8_t i;
     
-    if (timeout >= TIMEOUT_LONG) {
-        main_puts("[Timeout]"); 
+    if (sp->len <= 15 || span_find(sp, " 1970")) return 0;
+    
+    // Find time pattern HH:MM:SS (look for XX:XX:XX)
+    for (i = from; i + 7 < sp->len; i++) {
+        if (SPAN_AT(sp, i) >= '0' && SPAN_AT(sp, i) <= '2' &&
+            SPAN_AT(sp, i+1) >= '0' && SPAN_AT(sp, i+1) <= '9' &&
+            SPAN_AT(sp, i+2) == ':' &&
+            SPAN_AT(sp, i+3) >= '0' && SPAN_AT(sp, i+3) <= '5' &&
+            SPAN_AT(sp, i+4) >= '0' && SPAN_AT(sp, i+4) <= '9' &&
+            SPAN_AT(sp, i+5) == ':' &&
+            SPAN_AT(sp, i+6) >= '0' && SPAN_AT(sp, i+6) <= '5' &&
+            SPAN_AT(sp, i+7) >= '0' && SPAN_AT(sp, i+7) <= '9') {
+            // Found HH:MM:SS: el reloj local arranca desde aquí
+            clock_secs = (SPAN_AT(sp, i) - '0') * 36000UL + (SPAN_AT(sp, i+1) - '0') * 3600UL +
+                         (SPAN_AT(sp, i+3) - '0') * 600 + (SPAN_AT(sp, i+4) - '0') * 60 +
+                         (SPAN_AT(sp, i+6) - '0') * 10 + (SPAN_AT(sp, i+7) - '0');
+            clock_frame = timer_frames();
+            clock_age = 0;
+            clock_set = 1;
+            sntp_ok = 1;
+            clock_format();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const at_txn sntpcfg_txn = { 0, 0, TIMEOUT_FAST, AT_END };
+static const at_handler sntp_handlers[] = { { "+CIPSNTPTIME:", parse_sntp_time } };
+static const at_txn sntp_txn = { sntp_handlers, 1, TIMEOUT_FAST, AT_END | AT_SHOW };
+
+static void time_done(uint8_t result)
+{
+    current_attr = ATTR_LOCAL;
+    if (sntp_ok) {
+        main_puts("Time set: ");
+        main_puts(device_time);
+        main_newline();
+    } else {
+        main_puts("Sync failed (try again in a few seconds)");
         main_newline();
     }
+    
+    draw_status_bar();
 }
 
-static void cmd_info(void) { uart_flush_rx(); uart_send_string("AT+GMR\r\n"); wait_at_response(); }
+static void time_query(uint8_t result)
+{
+    current_attr = ATTR_LOCAL;
+    main_puts("Getting time...");
+    main_newline();
+    
+    sntp_ok = 0;
+    job_start("AT+CIPSNTPTIME?\r\n", &sntp_txn, time_done);
+}
 
-static void cmd_debug(void) { debug_mode = !debug_mode; current_attr = ATTR_LOCAL; main_puts(debug_mode ? "Debug ON" : "Debug OFF"); main_newline(); }
+static void time_sync_wait(uint8_t result)
+{
+    // Wait for NTP sync (needs several seconds)
+    current_attr = ATTR_LOCAL;
+    main_puts("Syncing...");
+    main_newline();
+    job_after(1200, time_query);
+}
 
 static void cmd_time(void)
 {
-    uint16_t timeout;
-    uint8_t i, wait;
-    uint8_t found = 0;
-    
     current_attr = ATTR_LOCAL;
     main_puts("Configuring NTP...");
     main_newline();
     
     // Configure SNTP (timezone 1 = CET for Spain)
     // Using multiple NTP servers for reliability
-    uart_flush_hard();
-    uart_send_string("AT+CIPSNTPCFG=1,1,\"pool.ntp.org\",\"time.google.com\"\r\n");
-    rx_pos = 0;
-    timeout = 0;
-    while (timeout < 20000) {
-        if (try_read_line()) {
-            if (debug_mode) { 
-                current_attr = ATTR_DEBUG;
-                main_puts("CFG:"); main_puts(rx_line); main_newline(); 
-            }
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            if (rx_pos >= 5 && rx_line[0] == 'E' && rx_line[1] == 'R') break;
-            rx_pos = 0;
-        }
-        timeout++;
+    job_start("AT+CIPSNTPCFG=1,1,\"pool.ntp.org\",\"time.google.com\"\r\n", &sntpcfg_txn, time_sync_wait);
+}
+
+// Relectura del reloj en segundo plano. El ESP mantiene la hora por su
+// cuenta desde el !TIME, así que basta con la consulta
+static const at_txn sntp_quiet_txn = { sntp_handlers, 1, TIMEOUT_FAST, AT_END };
+
+static void clock_done(uint8_t result)
+{
+    if (sntp_ok) print_padded(STATUS_LINE, 54, device_time, ATTR_VAL, 5);
+    else clock_age = CLOCK_RESYNC - CLOCK_RETRY;
+}
+
+static void clock_resync(void)
+{
+    // Como rssi_refresh(): sin at_sync() y solo con el buffer vacío
+    if (!clock_set || connection_status != 1 || clock_age < CLOCK_RESYNC || rb_tail != rb_head) return;
+    
+    sntp_ok = 0;
+    uart_send_string("AT+CIPSNTPTIME?\r\n");
+    job_start(0, &sntp_quiet_txn, clock_done);
+}
+
+static void cmd_rst(void)
+{
+    uint8_t i;
+    current_attr = ATTR_LOCAL;
+    main_puts("Resetting ESP...");
+    main_newline();
+    
+    uart_flush_hard();
+    uart_send_string("AT+RST\r\n");
+    
+    // Tras el reset el ESP vuelve a su configuración guardada, con
+    // recepción activa y sin datos pendientes
+    uart_flow = 0;
+    uart_set_baud(UART_DEF_BAUD);
+    recv_passive = 0;
+    recv_pending = 0;
+    
+    for (i = 0; i < 100; i++) {
+        __asm__("ei");
+        __asm__("halt");
     }
     
-    // Wait for NTP sync (needs several seconds)
-    main_puts("Syncing");
-    for (wait = 0; wait < 60; wait++) {
+    uart_flush_rx();
+    main_puts("Done. Run !IP to check.");
+    main_newline();
+}
+
+static void cmd_mac(void)
+{
+    job_start("AT+CIPSTAMAC?\r\n", &at_wait, 0);
+}
+
+static void cmd_raw(void)
+{
+    uint8_t c;
+    int16_t val;
+    uint16_t timeout;
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("=== RAW MODE (SPACE to exit) ===");
+    main_newline();
+    
+    current_attr = ATTR_DEBUG;
+    
+    while (1) {
+        c = in_inkey();
+        if (c == ' ') break;
+        
+        uart_drain_to_buffer();
+        timeout = 0;
+        while (timeout < 100 && (val = rb_pop()) != -1) {
+            c = (uint8_t)val;
+            if (c >= 32 && c < 127) {
+                main_putchar(c);
+            } else if (c == 13 || c == 10) {
+                main_newline();
+            } else {
+                main_putchar('<');
+                main_putchar("0123456789ABCDEF"[c >> 4]);
+                main_putchar("0123456789ABCDEF"[c & 0x0F]);
+                main_putchar('>');
+            }
+            timeout++;
+        }
+        
         __asm__("ei");
         __asm__("halt");
-        if ((wait % 10) == 0) main_putchar('.');
     }
+    
+    current_attr = ATTR_LOCAL;
     main_newline();
+    main_puts("=== END RAW ===");
+    main_newline();
+}
+
+static uint8_t cwjap_error; // 0: Desconocido, 1:Timeout, 2:Pass, 3:SSID, 4:Fail
+
+// El ESP envía "+CWJAP:1" (o 2, 3, 4) antes de enviar "FAIL"
+static uint8_t parse_cwjap_error(const rx_span *sp, uint8_t from)
+{
+    uint8_t c;
     
-    // Query time
-    main_puts("Getting time...");
+    if (from >= sp->len) return 0;
+    c = SPAN_AT(sp, from);
+    if (c >= '0' && c <= '4') cwjap_error = c - '0';
+    return 0;
+}
+
+static const at_handler cwjap_set_handlers[] = { { "+CWJAP:", parse_cwjap_error } };
+static const at_txn cwjap_set_txn = { cwjap_set_handlers, 1, TIMEOUT_LONG, AT_END | AT_SHOW };
+
+static void connect_done(uint8_t result)
+{
+    switch (result) {
+    case RESP_GOT_OK:
+        current_attr = ATTR_LOCAL;
+        main_puts("Success!"); main_newline();
+        check_connection(); // Actualiza IP y Status Bar
+        // IMPORTANTE: Forzar refresco visual inmediato
+        draw_status_bar(); 
+        return;
+        
+    case RESP_GOT_ERROR: // FAIL o ERROR
+        current_attr = ATTR_LOCAL;
+        main_newline();
+        main_puts("Connection Failed:"); main_newline();
+        
+        // Explicación detallada
+        switch(cwjap_error) {
+            case 1: main_puts("> Timeout / Router busy"); break;
+            case 2: main_puts("> Wrong Password"); break;
+            case 3: main_puts("> SSID not found"); break;
+            case 4: main_puts("> Connection Failed"); break;
+            default: main_puts("> Unknown Error"); break;
+        }
+        main_newline();
+        return;
+    }
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Terminal Timeout."); main_newline();
+}
+
+static void cmd_connect(void)
+{
+    uint8_t i;
+    char cmd[80];
+
+    // --- PARSEO (Igual que tenías) ---
+    i = 8;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (i >= line_len) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Usage: !CONNECT ssid,pass"); main_newline();
+        return;
+    }
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Connecting..."); main_newline();
+    
+    // Construcción del comando AT (Copiado de tu lógica v8)
+    strcpy(cmd, "AT+CWJAP=\"");
+    uint8_t pos = 10;
+    while (i < line_len && line_buffer[i] != ',' && pos < 70) cmd[pos++] = line_buffer[i++];
+    if (line_buffer[i] == ',') i++;
+    while (i < line_len && line_buffer[i] == ' ') i++; 
+    cmd[pos++] = '"'; cmd[pos++] = ','; cmd[pos++] = '"';
+    while (i < line_len && pos < 78) cmd[pos++] = line_buffer[i++];
+    cmd[pos++] = '"'; cmd[pos++] = '\r'; cmd[pos++] = '\n'; cmd[pos] = 0;
+    
+    cwjap_error = 0;
+    job_start(cmd, &cwjap_set_txn, connect_done);
+}
+
+static void disconnect_done(uint8_t result)
+{
+    strcpy(device_ip, "---");
+    strcpy(device_ssid, "---");
+    device_rssi = 0;
+    connection_status = 0;
+    draw_status_bar();
+}
+
+static void cmd_disconnect(void)
+{
+    current_attr = ATTR_LOCAL;
+    main_puts("Disconnecting...");
+    main_newline();
+    
+    job_start("AT+CWQAP\r\n", &at_wait, disconnect_done);
+}
+
+static void cmd_ping(void)
+{
+    uint8_t i;
+    char cmd[40];
+    
+    // Parse: !PING ip
+    i = 5;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    
+    if (i >= line_len) {
+        // Default ping
+        strcpy(cmd, "AT+PING=\"8.8.8.8\"\r\n");
+    } else {
+        strcpy(cmd, "AT+PING=\"");
+        uint8_t pos = 9;
+        while (i < line_len && pos < 35) {
+            cmd[pos++] = line_buffer[i++];
+        }
+        cmd[pos++] = '"';
+        cmd[pos++] = '\r';
+        cmd[pos++] = '\n';
+        cmd[pos] = 0;
+    }
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Pinging...");
+    main_newline();
+    
+    job_start(cmd, &at_wait, 0);
+}
+
+// AT+UART_CUR para 'rate' manteniendo el modo de control de flujo actual
+// (2 = el ESP respeta nuestro CTS)
+static void uart_cur_command(char *cmd, uint16_t rate)
+{
+    char num[8];
+    
+    u16_to_dec(num, rate);
+    strcpy(cmd, "AT+UART_CUR=");
+    strcat(cmd, num);
+    strcat(cmd, uart_flow ? ",8,1,0,2\r\n" : ",8,1,0,0\r\n");
+}
+
+// Velocidad que el driver puede seguir en el modo actual
+static uint8_t uart_rate_usable(uint16_t rate)
+{
+    return uart_flow ? uart_flow_usable(rate) : uart_baud_usable(rate);
+}
+
+#define SWITCH_OK       0
+#define SWITCH_REJECTED 1   // El ESP no aceptó el AT+UART_CUR
+#define SWITCH_REVERTED 2   // No contestó a la nueva: de vuelta a la anterior
+#define SWITCH_LOST     3   // Tampoco contesta a la anterior
+
+// Pasa los dos lados a 'rate' y lo comprueba con AT
+static uint8_t uart_switch(uint16_t rate)
+{
+    uint16_t old_rate = uart_baud;
+    uint8_t k;
+    char cmd[40];
+    
+    uart_cur_command(cmd, rate);
+    
+    // El ESP contesta OK a la velocidad vieja y después cambia
+    if (at_transact(cmd, &at_wait) != RESP_GOT_OK) return SWITCH_REJECTED;
+    
+    uart_set_baud(rate);
+    for (k = 0; k < 5; k++) __asm__("halt");
+    if (probe_esp()) return SWITCH_OK;
+    
+    // Sin respuesta: volver a la velocidad anterior por los dos lados
+    uart_cur_command(cmd, old_rate);
+    uart_send_string(cmd);
+    for (k = 0; k < 5; k++) __asm__("halt");
+    
+    uart_set_baud(old_rate);
+    return probe_esp() ? SWITCH_REVERTED : SWITCH_LOST;
+}
+
+static void cmd_baud(void)
+{
+    uint8_t i;
+    uint8_t k;
+    uint32_t value = 0;
+    uint16_t rate;
+    char rate_str[8];
+    
+    // Parse: !BAUD rate
+    i = 5;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    
+    while (i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9' && value < 1000000UL) {
+        value = value * 10 + (line_buffer[i++] - '0');
+    }
+    
+    current_attr = ATTR_LOCAL;
+    
+    // Solo velocidades de la tabla que el driver pueda seguir a este reloj
+    rate = 0;
+    for (k = 0; k < BAUD_RATES_COUNT; k++) {
+        if (baud_rates[k] == value && uart_rate_usable(baud_rates[k])) rate = baud_rates[k];
+    }
+    
+    if (!rate) {
+        main_puts("Usage: !BAUD rate (");
+        for (k = 0; k < BAUD_RATES_COUNT; k++) {
+            if (!uart_rate_usable(baud_rates[k])) continue;
+            if (k) main_puts(",");
+            u16_to_dec(rate_str, baud_rates[k]);
+            main_puts(rate_str);
+        }
+        main_puts(")");
+        main_newline();
+        return;
+    }
+    
+    if (rate == uart_baud) {
+        main_puts("Already at that rate");
+        main_newline();
+        return;
+    }
+    
+    u16_to_dec(rate_str, rate);
+    main_puts("Setting baud to ");
+    main_puts(rate_str);
+    main_puts("...");
     main_newline();
     
+    switch (uart_switch(rate)) {
+    case SWITCH_OK:       main_puts("Baud rate changed (until ESP reset)"); break;
+    case SWITCH_REJECTED: main_puts("ESP rejected new rate"); break;
+    case SWITCH_REVERTED: main_puts("No reply at new rate, reverted"); break;
+    default:              main_puts("ESP lost - use !RST"); break;
+    }
+    main_newline();
+}
+
+static void cmd_flow(void)
+{
+    char cmd[40];
+    
+    current_attr = ATTR_LOCAL;
+    
+    if (!uart_flow && !uart_flow_usable(uart_baud)) {
+        main_puts("Flow control needs a lower !BAUD");
+        main_newline();
+        return;
+    }
+    
+    at_sync();
+    uart_flow = !uart_flow;
+    uart_cur_command(cmd, uart_baud);
+    uart_send_string(cmd);
+    
+    // El OK puede salir antes o después del cambio: se comprueba con AT
     uart_flush_hard();
-    uart_send_string("AT+CIPSNTPTIME?\r\n");
-    rx_pos = 0;
-    timeout = 0;
-    
-    while (timeout < 30000) {
-        if (try_read_line()) {
-            // Always show response for debugging
-            current_attr = ATTR_DEBUG;
-            main_puts("RAW:"); 
-            main_puts(rx_line); 
-            main_newline();
-            
-            // +CIPSNTPTIME:Thu Jan 01 00:00:00 1970  (not synced)
-            // +CIPSNTPTIME:Fri Dec 27 21:45:30 2024  (synced)
-            if (rx_pos > 15 && rx_line[0] == '+' && rx_line[1] == 'C' &&
-                rx_line[2] == 'I' && rx_line[3] == 'P' && rx_line[4] == 'S' &&
-                rx_line[5] == 'N' && rx_line[6] == 'T' && rx_line[7] == 'P' &&
-                rx_line[8] == 'T' && rx_line[9] == 'I' && rx_line[10] == 'M' &&
-                rx_line[11] == 'E' && rx_line[12] == ':') {
-                
-                // Check if it's 1970 (not synced)
-                uint8_t is_1970 = 0;
-                for (i = rx_pos - 4; i < rx_pos; i++) {
-                    if (rx_line[i] == '1' && rx_line[i+1] == '9' && 
-                        rx_line[i+2] == '7' && rx_line[i+3] == '0') {
-                        is_1970 = 1;
-                        break;
-                    }
-                }
-                
-                if (!is_1970) {
-                    // Find time pattern HH:MM:SS (look for XX:XX:XX)
-                    for (i = 13; i < rx_pos - 7; i++) {
-                        if (rx_line[i] >= '0' && rx_line[i] <= '2' &&
-                            rx_line[i+1] >= '0' && rx_line[i+1] <= '9' &&
-                            rx_line[i+2] == ':' &&
-                            rx_line[i+3] >= '0' && rx_line[i+3] <= '5' &&
-                            rx_line[i+4] >= '0' && rx_line[i+4] <= '9' &&
-                            rx_line[i+5] == ':') {
-                            // Found HH:MM:SS
-                            device_time[0] = rx_line[i];
-                            device_time[1] = rx_line[i+1];
-                            device_time[2] = ':';
-                            device_time[3] = rx_line[i+3];
-                            device_time[4] = rx_line[i+4];
-                            device_time[5] = 0;
-                            found = 1;
-                            break;
-                        }
-                    }
-                }
-            }
-            
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') break;
-            if (rx_pos >= 5 && rx_line[0] == 'E' && rx_line[1] == 'R') break;
-            rx_pos = 0;
+    if (probe_esp()) {
+        main_puts(uart_flow ? "Flow control ON (until ESP reset)" : "Flow control OFF");
+        main_newline();
+        return;
+    }
+    
+    // El ESP no contesta así: volver al modo anterior por los dos lados
+    uart_flow = !uart_flow;
+    uart_cur_command(cmd, uart_baud);
+    uart_send_string(cmd);
+    uart_flush_hard();
+    main_puts("Flow control not available");
+    main_newline();
+}
+
+// main_puts rellenando con espacios hasta 'width' columnas
+static void main_puts_padded(const char *s, uint8_t width)
+{
+    uint8_t n = strlen(s);
+    
+    main_puts(s);
+    while (n++ < width) main_putchar(' ');
+}
+
+// Imprime 'v' (tantos por mil) como porcentaje con un decimal
+static void print_permille(int16_t v, uint8_t sign)
+{
+    char num[8];
+    
+    if (v < 0) { main_putchar('-'); v = -v; }
+    else if (sign) main_putchar('+');
+    u16_to_dec(num, v / 10);
+    main_puts(num);
+    main_putchar('.');
+    main_putchar('0' + v % 10);
+    main_putchar('%');
+}
+
+// Lo que las tablas del driver dan para cada velocidad con el reloj actual:
+// error de baudios en TX, peor desvío de muestreo en RX, bytes/s en ráfaga
+// de TX y si se puede recibir (con o sin control de flujo). Sale de los
+// mismos costes UART_*_T con que se calculan, así que no los comprueba:
+// eso lo hace "make test" (tools/uart_test.py) simulando ay_uart.asm
+static void cmd_uart(void)
+{
+    uint8_t i, k;
+    uint8_t rx[8], tx[10];
+    uint16_t bit_t16;
+    int32_t now, off, worst;
+    char num[8];
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Clock ");
+    u16_to_dec(num, (uint16_t)(cpu_clock / 1000));
+    main_puts(num);
+    main_puts(" kHz, ");
+    u16_to_dec(num, uart_baud);
+    main_puts(num);
+    main_puts(" bps, flow ");
+    main_puts(uart_flow ? "ON" : "OFF");
+    main_newline();
+    main_puts(" Rate   Bit T  TX err  RX off  TX B/s  Use");
+    main_newline();
+    
+    for (k = 0; k < BAUD_RATES_COUNT; k++) {
+        bit_t16 = (uint16_t)((cpu_clock * 16UL) / baud_rates[k]);
+        uart_calc_timing(bit_t16, rx, tx);
+        
+        main_putchar(baud_rates[k] == uart_baud ? '*' : ' ');
+        u16_to_dec(num, baud_rates[k]);
+        main_puts_padded(num, 7);
+        u16_to_dec(num, bit_t16 / 16);
+        main_puts_padded(num, 7);
+        
+        // TX: duración real de start + 8 datos frente a la ideal
+        now = 0;
+        for (i = 0; i < 9; i++) now += (UART_TX_BIT_T + (int32_t)tx[i] * UART_LOOP_T) * 16;
+        off = (now - (int32_t)bit_t16 * 9) * 1000 / ((int32_t)bit_t16 * 9);
+        print_permille((int16_t)off, 1);
+        main_puts("  ");
+        
+        // RX: peor distancia de una muestra al centro de su bit
+        now = 0;
+        worst = 0;
+        for (i = 0; i < 8; i++) {
+            now += ((i == 0 ? UART_RX_FIRST_T : UART_RX_BIT_T) + (int32_t)rx[i] * UART_LOOP_T) * 16;
+            off = now - (int32_t)bit_t16 * (3 + 2 * i) / 2;
+            if (off < 0) off = -off;
+            if (off > worst) worst = off;
         }
-        timeout++;
+        print_permille((int16_t)(worst * 1000 / bit_t16), 0);
+        main_puts("    ");
+        
+        // Ráfaga de TX con ay_uart_send_block
+        now = 9 * UART_TX_BIT_T + UART_TX_STOP_T + UART_TX_BLOCK_T;
+        for (i = 0; i < 10; i++) now += (int32_t)tx[i] * UART_LOOP_T;
+        u16_to_dec(num, (uint16_t)(cpu_clock / now));
+        main_puts_padded(num, 8);
+        if (uart_flow_usable(baud_rates[k])) main_puts("RX+F");
+        else main_puts(uart_baud_usable(baud_rates[k]) ? "RX" : "-");
+        main_newline();
     }
+}
+
+// Una fila de !STATS: etiqueta en columna fija y valor
+static void stats_row(const char *label, uint16_t val)
+{
+    char num[8];
     
-    uart_flush_rx();
+    main_puts_padded(label, 16);
+    u16_to_dec(num, val);
+    main_puts(num);
+    main_newline();
+}
+
+// Contadores de recepción; "!STATS R" los pone a cero
+static void cmd_stats(void)
+{
+    uint8_t i = 6;
+    char num[12];
     
     current_attr = ATTR_LOCAL;
-    if (found) {
-        main_puts("Time set: ");
-        main_puts(device_time);
+    
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (line_buffer[i] == 'R' || line_buffer[i] == 'r') {
+        memset(&rx_stats, 0, sizeof(rx_stats));
+        main_puts("Stats reset");
         main_newline();
+        return;
+    }
+    
+    main_puts_padded("RX bytes", 16);
+    u32_to_dec(num, rx_stats.rx_bytes);
+    main_puts(num);
+    main_newline();
+    
+    main_puts_padded("Buffer peak", 16);
+    u16_to_dec(num, rx_stats.rb_peak);
+    main_puts(num);
+    main_puts(" / ");
+    u16_to_dec(num, RING_BUFFER_SIZE - 1);
+    main_puts(num);
+    main_newline();
+    
+    stats_row("Full stops", rx_stats.full_stops);
+    stats_row("Flushed bytes", rx_stats.flushed);
+    stats_row("Long lines", rx_stats.long_lines);
+    stats_row("Binary bytes", rx_stats.binary_bytes);
+    stats_row("Noise lines", rx_stats.noise_lines);
+}
+
+// ============================================================
+// TCP TRANSPARENT MODE
+// ============================================================
+
+#define TCP_RENDER_MAX 48   // Bytes pintados por frame como mucho
+
+static const at_txn tcp_open_txn = { 0, 0, TIMEOUT_LONG, AT_END | AT_SHOW };
+static const at_txn tcp_quiet_txn = { 0, 0, TIMEOUT_FAST, AT_END };
+
+static uint16_t tcp_tx;
+static uint32_t tcp_dropped;
+
+// La barra de estado pasa a ser el medidor de la sesión: bytes/s
+// recibidos y dos contadores
+static void meter_status(const char *title, uint16_t rate, const char *l1, uint32_t v1, const char *l2, uint32_t v2)
+{
+    char num[11];
+    
+    clear_line(STATUS_LINE, ATTR_STATUS);
+    print_str64(STATUS_LINE, 0, title, ATTR_LBL);
+    print_str64(STATUS_LINE, 4, "RX:", ATTR_LBL);
+    u16_to_dec(num, rate);
+    strcat(num, " B/s");
+    print_padded(STATUS_LINE, 8, num, ATTR_VAL, 10);
+    
+    print_str64(STATUS_LINE, 20, l1, ATTR_LBL);
+    u32_to_dec(num, v1);
+    print_padded(STATUS_LINE, 20 + strlen(l1), num, ATTR_VAL, 10);
+    
+    print_str64(STATUS_LINE, 35, l2, ATTR_LBL);
+    u32_to_dec(num, v2);
+    print_padded(STATUS_LINE, 35 + strlen(l2), num, ATTR_VAL, 10);
+    
+    print_str64(STATUS_LINE, 53, "BREAK=exit", ATTR_LBL);
+}
+
+static void tcp_status(uint16_t rate)
+{
+    meter_status("TCP", rate, "TX:", tcp_tx, "Drop:", tcp_dropped);
+}
+
+// AT+CIPSTART de una conexión TCP a host:port
+static void cipstart_command(char *cmd, const char *host, uint16_t port)
+{
+    char num[8];
+    
+    strcpy(cmd, "AT+CIPSTART=\"TCP\",\"");
+    strcat(cmd, host);
+    strcat(cmd, "\",");
+    u16_to_dec(num, port);
+    strcat(cmd, num);
+    strcat(cmd, "\r\n");
+}
+
+// Tras el OK de AT+CIPSEND el ESP manda '>' sin fin de línea
+static void wait_send_prompt(void)
+{
+    uint16_t deadline = deadline_in(TIMEOUT_PROBE);
+    while (rb_pop() != '>' && !deadline_passed(deadline)) rx_fill();
+}
+
+// Lo recibido va del ring buffer a la pantalla tal cual, sin partir en
+// líneas. Si la pantalla no da abasto se tira lo más viejo y se cuenta:
+// mejor un hueco contado que un buffer lleno perdiendo bytes en el cable
+static void tcp_render(void)
+{
+    uint16_t used;
+    uint8_t n;
+    int16_t c;
+    
+    used = (rb_head - rb_tail) & RB_MASK;
+    if (used > RING_BUFFER_SIZE / 2) {
+        used -= RING_BUFFER_SIZE / 4;
+        rb_tail = (rb_tail + used) & RB_MASK;
+        rb_line_len = 0;
+        tcp_dropped += used;
+    }
+    
+    current_attr = ATTR_RESPONSE;
+    for (n = 0; n < TCP_RENDER_MAX && (c = rb_pop()) != -1; n++) {
+        if (c == 10) main_newline();
+        else if (c >= 32 && c < 127) main_putchar((uint8_t)c);
+    }
+}
+
+static void cmd_tcp(void)
+{
+    char host[40], cmd[64];
+    uint8_t i, j, k, last = 0;
+    uint16_t port = 0;
+    uint32_t rx_mark, ms;
+    elapsed_mark meter;
+    
+    current_attr = ATTR_LOCAL;
+    
+    // Parse: !TCP host,port
+    i = 4;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    j = 0;
+    while (i < line_len && line_buffer[i] != ',' && j < sizeof(host) - 1) host[j++] = line_buffer[i++];
+    host[j] = 0;
+    if (i < line_len && line_buffer[i] == ',') {
+        while (++i < line_len && line_buffer[i] == ' ');
     } else {
-        main_puts("Sync failed (try again in a few seconds)");
-        main_newline();
-        strcpy(device_time, "--:--");
+        j = 0;
+    }
+    if (j == 0 || i == line_len || line_buffer[i] < '0' || line_buffer[i] > '9') {
+        main_puts("Usage: !TCP host,port"); main_newline();
+        return;
+    }
+    while (i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9') port = port * 10 + (line_buffer[i++] - '0');
+    cipstart_command(cmd, host, port);
+    
+    // El modo transparente solo existe con recepción activa
+    if (recv_passive) {
+        main_puts("Passive receive on: !RECV A first"); main_newline();
+        return;
+    }
+    
+    main_puts("Connecting..."); main_newline();
+    if (at_transact(cmd, &tcp_open_txn) != RESP_GOT_OK) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Connection failed"); main_newline();
+        return;
+    }
+    
+    if (at_transact("AT+CIPMODE=1\r\n", &tcp_quiet_txn) != RESP_GOT_OK ||
+        at_transact("AT+CIPSEND\r\n", &tcp_quiet_txn) != RESP_GOT_OK) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Transparent mode refused"); main_newline();
+        at_transact("AT+CIPMODE=0\r\n", &tcp_quiet_txn);
+        at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+        return;
+    }
+    
+    wait_send_prompt();
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Transparent mode. BREAK sends +++ and exits");
+    main_newline();
+    
+    tcp_tx = 0;
+    tcp_dropped = 0;
+    rx_mark = rx_stats.rx_bytes;
+    elapsed_start(&meter);
+    tcp_status(0);
+    
+    while (!in_key_pressed(KEY_BREAK)) {
+        idle_wait_frame();
+        tcp_render();
+        
+        // Cada pulsación sale al momento, sin eco local (lo devuelve el
+        // servidor si quiere) y sin auto-repeat
+        k = in_inkey();
+        if (k != last) {
+            last = k;
+            if (k == 13) {
+                uart_send_string("\r\n");
+                tcp_tx += 2;
+            } else if (k >= 32 && k <= 126) {
+                uart_send(&k, 1);
+                tcp_tx++;
+            }
+        }
+        
+        // Con una ráfaga el driver pasa varios frames en DI: el segundo se mide
+        ms = elapsed_ms(&meter);
+        if (ms >= 1000) {
+            tcp_status((uint16_t)((rx_stats.rx_bytes - rx_mark) * 1000 / ms));
+            rx_mark = rx_stats.rx_bytes;
+            elapsed_start(&meter);
+        }
+    }
+    
+    // "+++" tiene que llegar solo, con una pausa antes y después, y el ESP
+    // no acepta comandos hasta pasado un segundo
+    for (i = 0; i < 3; i++) {
+        __asm__("ei");
+        __asm__("halt");
+    }
+    uart_send_string("+++");
+    for (i = 0; i < 60; i++) {
+        __asm__("ei");
+        __asm__("halt");
+    }
+    rb_flush();
+    
+    at_transact("AT+CIPMODE=0\r\n", &tcp_quiet_txn);
+    at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+    
+    current_attr = ATTR_LOCAL;
+    main_newline();
+    main_puts("TCP session closed");
+    main_newline();
+    draw_status_bar();
+}
+
+// ============================================================
+// HTTP GET
+// ============================================================
+
+// Sin fichero el cuerpo va a RAM desde GET_RAM_ADDR: por encima del área
+// de trabajo de BASIC (STKEND) y por debajo de la pila, que el cargador
+// deja bajo RAMTOP justo debajo del programa. Nada reserva ese hueco, así
+// que el tamaño se acota en cada !GET con STKEND y la pila de ese momento
+#define GET_RAM_ADDR   24576
+#define GET_RAM_SIZE   8192
+#define GET_STACK_ROOM 512  // Lo que aún baja la pila bajo cmd_get() (llamadas, ROM, esxDOS)
+#define STKEND_ADDR    23653
+#define GET_SECTOR   512    // Escrituras a esxDOS de un sector
+
+#define GET_STATUS  0       // Esperando "HTTP/1.x nnn ..."
+#define GET_HEADERS 1
+#define GET_BODY    2
+
+static uint8_t get_sector[GET_SECTOR];  // La petición, y luego el cuerpo hacia el fichero
+static uint16_t get_fill;
+static char get_line[64];               // Línea de cabecera en curso
+static uint8_t get_line_len;
+static uint8_t get_state;
+static uint16_t get_code;
+static uint32_t get_length;             // Content-Length (0: hasta el CLOSED)
+static uint32_t get_body;               // Bytes de cuerpo recibidos
+static uint8_t *get_ram;
+static uint16_t get_ram_size;           // Hueco libre en GET_RAM_ADDR para este !GET
+static uint8_t get_file;                // Handle de esxDOS, 0xFF: a RAM
+static uint8_t get_error;               // Fallo de escritura o RAM llena
+
+static uint32_t str_to_u32(const char *p)
+{
+    uint32_t val = 0;
+    
+    while (*p == ' ') p++;
+    while (*p >= '0' && *p <= '9') val = val * 10 + (*p++ - '0');
+    return val;
+}
+
+// Línea de estado o de cabecera completa, sin CR/LF
+static void get_header_line(void)
+{
+    const char *p = get_line;
+    const char *k = "content-length:";
+    
+    get_line[get_line_len] = 0;
+    get_line_len = 0;
+    
+    if (get_state == GET_STATUS) {
+        while (*p && *p != ' ') p++;
+        get_code = (uint16_t)str_to_u32(p);
+        get_state = GET_HEADERS;
+        return;
+    }
+    
+    if (get_line[0] == 0) {
+        get_state = GET_BODY;
+        return;
+    }
+    
+    // Los nombres de cabecera no distinguen mayúsculas
+    while (*k && (*p | 0x20) == *k) { p++; k++; }
+    if (!*k) get_length = str_to_u32(p);
+}
+
+static void get_flush(void)
+{
+    if (get_fill && esxdos_f_write(get_file, get_sector, get_fill) != get_fill) get_error = 1;
+    get_fill = 0;
+}
+
+// Saca carga del +IPD en curso: las cabeceras byte a byte, el cuerpo a RAM
+// de una vez o al fichero por sectores. Devuelve los bytes consumidos
+static uint16_t get_payload(void)
+{
+    uint16_t n, room;
+    uint8_t c;
+    
+    if (get_state != GET_BODY) {
+        n = rx_read_payload(&c, 1);
+        if (n) {
+            if (c == 10) get_header_line();
+            else if (c != 13 && get_line_len < sizeof(get_line) - 1) get_line[get_line_len++] = c;
+        }
+        return n;
+    }
+    
+    if (get_file != 0xFF) {
+        n = rx_read_payload(get_sector + get_fill, GET_SECTOR - get_fill);
+        get_fill += n;
+        if (get_fill == GET_SECTOR) get_flush();
+    } else {
+        room = get_ram_size - (uint16_t)(get_ram - (uint8_t *)GET_RAM_ADDR);
+        if (room) {
+            n = rx_read_payload(get_ram, room);
+            get_ram += n;
+        } else {
+            n = rx_read_payload(0, 0xFFFF);
+            if (n) get_error = 1;
+        }
+    }
+    
+    get_body += n;
+    return n;
+}
+
+// Todo lo recibido hasta ahora. Devuelve 1 si el servidor ha cerrado
+static uint8_t get_receive(void)
+{
+    rx_span sp;
+    uint8_t closed = 0;
+    
+    while (1) {
+        if (rx_ipd_left) {
+            if (!get_payload()) break;
+            continue;
+        }
+        if (!rx_scan_line(&sp)) break;
+        if (span_find(&sp, "CLOSED")) closed = 1;
+        debug_show_span("~", &sp);
+        rx_release(&sp);
+    }
+    return closed;
+}
+
+static void cmd_get(void)
+{
+    char host[40], cmd[64], num[11];
+    const char *file;
+    uint8_t i, j, closed = 0;
+    uint16_t port = 80, len, deadline, top;
+    uint32_t rx_mark, body_mark = 0, ms;
+    elapsed_mark start, meter;
+    
+    current_attr = ATTR_LOCAL;
+    
+    // Los datos llegan con +IPD: sin recepción pasiva
+    if (recv_passive) {
+        main_puts("Passive receive on: !RECV A first"); main_newline();
+        return;
+    }
+    
+    // Parse: !GET [http://]host[:port][/path] [file]
+    i = 4;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (strncmp(line_buffer + i, "http://", 7) == 0) i += 7;
+    j = 0;
+    while (i < line_len && line_buffer[i] != ':' && line_buffer[i] != '/' &&
+           line_buffer[i] != ' ' && j < sizeof(host) - 1) host[j++] = line_buffer[i++];
+    host[j] = 0;
+    if (j == 0) {
+        main_puts("Usage: !GET host[:port]/path [file]"); main_newline();
+        return;
+    }
+    if (line_buffer[i] == ':') {
+        port = 0;
+        while (++i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9') port = port * 10 + (line_buffer[i] - '0');
+    }
+    
+    // HTTP/1.0: sin chunked, el cuerpo acaba con el cierre o Content-Length
+    strcpy((char *)get_sector, "GET ");
+    len = 4;
+    if (line_buffer[i] != '/') get_sector[len++] = '/';
+    while (i < line_len && line_buffer[i] != ' ' && len < 200) get_sector[len++] = line_buffer[i++];
+    get_sector[len] = 0;
+    strcat((char *)get_sector, " HTTP/1.0\r\nHost: ");
+    strcat((char *)get_sector, host);
+    strcat((char *)get_sector, "\r\nConnection: close\r\n\r\n");
+    len = strlen((char *)get_sector);
+    
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    file = line_buffer + i;
+    get_file = 0xFF;
+    if (!*file) {
+        // La dirección de una local es la pila de ahora
+        top = (uint16_t)&top - GET_STACK_ROOM;
+        if (*(uint16_t *)STKEND_ADDR > GET_RAM_ADDR || top <= GET_RAM_ADDR) {
+            main_puts("No free RAM at 24576: give a file"); main_newline();
+            return;
+        }
+        get_ram_size = top - GET_RAM_ADDR;
+        if (get_ram_size > GET_RAM_SIZE) get_ram_size = GET_RAM_SIZE;
+    } else {
+        get_file = esxdos_f_open((char *)file, ESXDOS_MODE_W | ESXDOS_MODE_CT);
+        if (get_file == 0xFF) {
+            main_puts("Cannot create file"); main_newline();
+            return;
+        }
+    }
+    
+    cipstart_command(cmd, host, port);
+    
+    main_puts("Connecting..."); main_newline();
+    if (at_transact(cmd, &tcp_open_txn) != RESP_GOT_OK) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Connection failed"); main_newline();
+        if (get_file != 0xFF) esxdos_f_close(get_file);
+        return;
+    }
+    
+    strcpy(cmd, "AT+CIPSEND=");
+    u16_to_dec(cmd + 11, len);
+    strcat(cmd, "\r\n");
+    if (at_transact(cmd, &tcp_quiet_txn) != RESP_GOT_OK) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Send refused"); main_newline();
+        at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+        if (get_file != 0xFF) esxdos_f_close(get_file);
+        return;
+    }
+    wait_send_prompt();
+    uart_send(get_sector, len);
+    
+    get_state = GET_STATUS;
+    get_code = 0;
+    get_length = 0;
+    get_body = 0;
+    get_fill = 0;
+    get_line_len = 0;
+    get_ram = (uint8_t *)GET_RAM_ADDR;
+    get_error = 0;
+    
+    elapsed_start(&start);
+    elapsed_start(&meter);
+    rx_mark = rx_stats.rx_bytes;
+    deadline = deadline_in(TIMEOUT_STD);
+    meter_status("GET", 0, "Got:", 0, "Size:", 0);
+    
+    while (!in_key_pressed(KEY_BREAK)) {
+        idle_wait_frame();
+        
+        // El plazo cuenta desde el último byte recibido
+        if (rx_stats.rx_bytes != rx_mark) {
+            rx_mark = rx_stats.rx_bytes;
+            deadline = deadline_in(TIMEOUT_STD);
+        } else if (deadline_passed(deadline)) {
+            break;
+        }
+        
+        closed = get_receive();
+        if (closed || (get_length && get_body >= get_length)) break;
+        
+        // Una vuelta puede durar varios frames en DI: el segundo se mide
+        ms = elapsed_ms(&meter);
+        if (ms >= 1000) {
+            meter_status("GET", (uint16_t)((get_body - body_mark) * 1000 / ms), "Got:", get_body, "Size:", get_length);
+            body_mark = get_body;
+            elapsed_start(&meter);
+        }
+    }
+    ms = elapsed_ms(&start);
+    
+    if (!closed) at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+    if (get_file != 0xFF) {
+        get_flush();
+        esxdos_f_close(get_file);
+    }
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("HTTP ");
+    u16_to_dec(num, get_code);
+    main_puts(get_code ? num : "---");
+    main_puts(": ");
+    u32_to_dec(num, get_body);
+    main_puts(num);
+    main_puts(" bytes in ");
+    u32_to_dec(num, ms / 1000);
+    main_puts(num);
+    main_puts(" s (");
+    u32_to_dec(num, (ms >= 10) ? get_body * 100 / (ms / 10) : 0);
+    main_puts(num);
+    main_puts(" B/s)");
+    main_newline();
+    
+    if (get_length && get_body < get_length) {
+        main_puts("Incomplete"); main_newline();
+    }
+    if (get_file != 0xFF) {
+        main_puts(get_error ? "Write error: " : "Saved to ");
+        main_puts(file);
+    } else {
+        if (get_error) {
+            u16_to_dec(num, get_ram_size);
+            main_puts("RAM full, first ");
+            main_puts(num);
+            main_puts(" bytes ");
+        }
+        main_puts("Stored at ");
+        u16_to_dec(num, GET_RAM_ADDR);
+        main_puts(num);
     }
-    
+    main_newline();
     draw_status_bar();
 }
 
-static void cmd_rst(void)
+// ============================================================
+// RX BENCHMARK
+// ============================================================
+
+// tools/bench_server.py manda N bytes de un LFSR de Galois de 16 bits (se
+// usa el byte bajo tras cada paso). Aquí se genera la misma secuencia para
+// verificar cada byte sin guardar nada. El tiempo lo mide el servidor: con
+// el driver en DI los frames se pierden, así que al tener los N bytes se le
+// manda una línea y contesta con los ms desde su primer byte
+
+#define BENCH_SEED    0xACE1
+#define BENCH_TAPS    0xB400
+#define BENCH_RESYNC  16        // Bytes que se buscan por delante tras un fallo
+#define BENCH_DEFAULT 8192
+
+static uint16_t bench_lfsr;
+static uint32_t bench_bad;
+static uint8_t bench_held;      // Byte que no casó, a la espera del siguiente
+static uint8_t bench_pending;
+
+static uint8_t bench_step(uint16_t *x)
 {
-    uint8_t i;
-    current_attr = ATTR_LOCAL;
-    main_puts("Resetting ESP...");
-    main_newline();
-    
-    uart_flush_hard();
-    uart_send_string("AT+RST\r\n");
+    uint8_t lsb = *x & 1;
     
-    for (i = 0; i < 100; i++) {
-        __asm__("ei");
-        __asm__("halt");
+    *x >>= 1;
+    if (lsb) *x ^= BENCH_TAPS;
+    return (uint8_t)*x;
+}
+
+// Un byte que no casa se guarda hasta ver el siguiente. Si la pareja
+// aparece seguida un poco más adelante en la secuencia hubo un hueco y se
+// sigue desde ahí; si no, era un byte corrupto. Con un solo byte el salto
+// acertaría por casualidad una vez de cada pocas y ya no se recuperaría
+static void bench_check(uint8_t c)
+{
+    uint16_t x, y;
+    uint8_t k;
+    
+    if (bench_pending) {
+        bench_pending = 0;
+        x = bench_lfsr;
+        for (k = 0; k < BENCH_RESYNC; k++) {
+            if (bench_step(&x) == bench_held) {
+                y = x;
+                if (bench_step(&y) == c) {
+                    bench_lfsr = y;
+                    return;
+                }
+            }
+        }
+        bench_bad++;
+        bench_step(&bench_lfsr);
     }
     
-    uart_flush_rx();
-    main_puts("Done. Run !IP to check.");
-    main_newline();
+    x = bench_lfsr;
+    if (bench_step(&x) == c) {
+        bench_lfsr = x;
+        return;
+    }
+    bench_held = c;
+    bench_pending = 1;
 }
 
-static void cmd_mac(void)
+// Una línea al servidor por la conexión abierta
+static uint8_t bench_send(const char *s)
 {
-    uart_flush_hard();
-    uart_send_string("AT+CIPSTAMAC?\r\n");
-    wait_at_response();
+    char cmd[24];
+    
+    strcpy(cmd, "AT+CIPSEND=");
+    u16_to_dec(cmd + 11, strlen(s));
+    strcat(cmd, "\r\n");
+    if (at_transact(cmd, &tcp_quiet_txn) != RESP_GOT_OK) return 0;
+    wait_send_prompt();
+    uart_send_string(s);
+    return 1;
 }
 
-static void cmd_raw(void)
+// Una pasada a la velocidad actual. Sin nada en pantalla mientras dura:
+// solo cuenta lo que cuesta recibir y verificar
+static void bench_run(const char *start_cmd, uint32_t n)
 {
-    uint8_t c;
-    uint16_t timeout;
+    rx_span sp;
+    uint8_t buf[64];
+    char num[11];
+    uint8_t i, m, closed = 0, acked = 0, timed = 0;
+    uint16_t deadline, peak;
+    uint32_t got = 0, ms = 0, rx_mark;
     
     current_attr = ATTR_LOCAL;
-    main_puts("=== RAW MODE (SPACE to exit) ===");
-    main_newline();
+    u16_to_dec(num, uart_baud);
+    main_puts(num);
+    main_puts(": ");
     
-    current_attr = ATTR_DEBUG;
+    if (at_transact(start_cmd, &tcp_quiet_txn) != RESP_GOT_OK) {
+        main_puts("connection failed"); main_newline();
+        return;
+    }
     
-    while (1) {
-        c = in_inkey();
-        if (c == ' ') break;
+    bench_lfsr = BENCH_SEED;
+    bench_bad = 0;
+    bench_pending = 0;
+    // El pico de la pasada se mide aparte y luego se devuelve a !STATS
+    peak = rx_stats.rb_peak;
+    rx_stats.rb_peak = 0;
+    
+    // Petición: el número de bytes en una línea
+    u32_to_dec(num, n);
+    strcat(num, "\n");
+    if (!bench_send(num)) {
+        main_puts("send failed"); main_newline();
+        at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+        rx_stats.rb_peak = peak;
+        return;
+    }
+    
+    rx_mark = rx_stats.rx_bytes;
+    deadline = deadline_in(TIMEOUT_FAST);
+    while (!timed && !closed && !in_key_pressed(KEY_BREAK)) {
+        idle_wait_frame();
         
-        timeout = 0;
-        while (ay_uart_ready() && timeout < 100) {
-            c = ay_uart_read();
-            if (c >= 32 && c < 127) {
-                main_putchar(c);
-            } else if (c == 13 || c == 10) {
-                main_newline();
-            } else {
-                main_putchar('<');
-                main_putchar("0123456789ABCDEF"[c >> 4]);
-                main_putchar("0123456789ABCDEF"[c & 0x0F]);
-                main_putchar('>');
+        if (rx_stats.rx_bytes != rx_mark) {
+            rx_mark = rx_stats.rx_bytes;
+            deadline = deadline_in(TIMEOUT_FAST);
+        } else if (deadline_passed(deadline)) {
+            break;
+        }
+        
+        while (1) {
+            if (rx_ipd_left) {
+                m = rx_read_payload(buf, sizeof(buf));
+                if (!m) break;
+                // Tras el flujo solo llegan los ms del servidor
+                for (i = 0; i < m; i++) {
+                    if (got < n) {
+                        bench_check(buf[i]);
+                        got++;
+                    } else if (buf[i] >= '0' && buf[i] <= '9') {
+                        ms = ms * 10 + (buf[i] - '0');
+                    } else if (buf[i] == '\n') {
+                        timed = 1;
+                    }
+                }
+                continue;
             }
-            timeout++;
+            if (!rx_scan_line(&sp)) break;
+            if (span_find(&sp, "CLOSED")) closed = 1;
+            rx_release(&sp);
         }
         
-        __asm__("ei");
-        __asm__("halt");
+        if (got == n && !acked) {
+            acked = 1;
+            if (!bench_send("\n")) break;
+            rx_mark = rx_stats.rx_bytes;
+            deadline = deadline_in(TIMEOUT_FAST);
+        }
     }
     
+    if (!closed) at_transact("AT+CIPCLOSE\r\n", &tcp_quiet_txn);
+    if (bench_pending) bench_bad++;
+    
     current_attr = ATTR_LOCAL;
+    u32_to_dec(num, got);
+    main_puts(num);
+    main_puts(" B, ");
+    if (timed && ms) {
+        u32_to_dec(num, got * 1000 / ms);
+        main_puts(num);
+    } else {
+        main_puts("---");
+    }
+    main_puts(" B/s, lost ");
+    u32_to_dec(num, n - got);
+    main_puts(num);
+    main_puts(", bad ");
+    u32_to_dec(num, bench_bad);
+    main_puts(num);
+    main_puts(", peak ");
+    u16_to_dec(num, rx_stats.rb_peak);
+    main_puts(num);
     main_newline();
-    main_puts("=== END RAW ===");
-    main_newline();
+    
+    if (peak > rx_stats.rb_peak) rx_stats.rb_peak = peak;
 }
 
-static void cmd_connect(void)
+static void cmd_bench(void)
 {
-    uint8_t i;
-    char cmd[80];
-    uint8_t cwjap_error = 0; // 0: Desconocido, 1:Timeout, 2:Pass, 3:SSID, 4:Fail
-
-    // --- PARSEO (Igual que tenías) ---
-    i = 8;
-    while (i < line_len && line_buffer[i] == ' ') i++;
-    if (i >= line_len) {
-        current_attr = ATTR_LOCAL;
-        main_puts("Usage: !CONNECT ssid,pass"); main_newline();
-        return;
-    }
+    char host[40], cmd[64];
+    uint8_t i, j, k, all = 0;
+    uint16_t port = 0, old_rate = uart_baud;
+    uint32_t n = 0;
     
     current_attr = ATTR_LOCAL;
-    main_puts("Connecting..."); main_newline();
     
-    // Construcción del comando AT (Copiado de tu lógica v8)
-    strcpy(cmd, "AT+CWJAP=\"");
-    uint8_t pos = 10;
-    while (i < line_len && line_buffer[i] != ',' && pos < 70) cmd[pos++] = line_buffer[i++];
-    if (line_buffer[i] == ',') i++;
-    while (i < line_len && line_buffer[i] == ' ') i++; 
-    cmd[pos++] = '"'; cmd[pos++] = ','; cmd[pos++] = '"';
-    while (i < line_len && pos < 78) cmd[pos++] = line_buffer[i++];
-    cmd[pos++] = '"'; cmd[pos++] = '\r'; cmd[pos++] = '\n'; cmd[pos] = 0;
+    if (recv_passive) {
+        main_puts("Passive receive on: !RECV A first"); main_newline();
+        return;
+    }
     
-    uart_flush_hard();
-    uart_send_string(cmd);
+    // Parse: !BENCH host:port [bytes] [ALL]
+    i = 6;
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    j = 0;
+    while (i < line_len && line_buffer[i] != ':' && line_buffer[i] != ' ' && j < sizeof(host) - 1) host[j++] = line_buffer[i++];
+    host[j] = 0;
+    if (line_buffer[i] == ':') {
+        while (++i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9') port = port * 10 + (line_buffer[i] - '0');
+    }
+    if (j == 0 || port == 0) {
+        main_puts("Usage: !BENCH host:port [bytes] [ALL]"); main_newline();
+        return;
+    }
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    while (i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9') n = n * 10 + (line_buffer[i++] - '0');
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (line_buffer[i] == 'A' || line_buffer[i] == 'a') all = 1;
+    if (n == 0) n = BENCH_DEFAULT;
     
-    // --- NUEVA LÓGICA DE ESPERA ---
-    uint32_t timeout = 0;
-    rx_pos = 0;
+    cipstart_command(cmd, host, port);
     
-    while (timeout < TIMEOUT_LONG) { // Timeout largo
-        if (try_read_line()) {
-            
-            // 1. CAPTURAR ERROR ESPECÍFICO
-            // El ESP envía "+CWJAP:1" (o 2, 3, 4) antes de enviar "FAIL"
-            if (rx_pos >= 7 && rx_line[0] == '+' && rx_line[1] == 'C' && rx_line[2] == 'W') {
-                // Chequeo rápido de string "+CWJAP:"
-                if (rx_line[6] == ':' && rx_line[7] >= '0' && rx_line[7] <= '4') {
-                    cwjap_error = rx_line[7] - '0';
-                }
-            }
-            
-            // Mostrar respuesta en pantalla (Debug visual)
-            if (is_valid_response() || is_terminator()) show_rx_line();
-            
-            // 2. ÉXITO
-            if (rx_pos >= 2 && rx_line[0] == 'O' && rx_line[1] == 'K') {
-                current_attr = ATTR_LOCAL;
-                main_puts("Success!"); main_newline();
-                check_connection(); // Actualiza IP y Status Bar
-                // IMPORTANTE: Forzar refresco visual inmediato
-                draw_status_bar(); 
-                return;
-            }
-            
-            // 3. FALLO (FAIL o ERROR)
-            if ((rx_pos >= 4 && rx_line[0] == 'F' && rx_line[1] == 'A') || 
-                (rx_pos >= 5 && rx_line[0] == 'E' && rx_line[1] == 'R')) {
-                
-                current_attr = ATTR_LOCAL;
-                main_newline();
-                main_puts("Connection Failed:"); main_newline();
-                
-                // Explicación detallada
-                switch(cwjap_error) {
-                    case 1: main_puts("> Timeout / Router busy"); break;
-                    case 2: main_puts("> Wrong Password"); break;
-                    case 3: main_puts("> SSID not found"); break;
-                    case 4: main_puts("> Connection Failed"); break;
-                    default: main_puts("> Unknown Error"); break;
-                }
-                main_newline();
-                return;
-            }
-            rx_pos = 0;
-        }
-        timeout++;
+    if (!all) {
+        bench_run(cmd, n);
+        return;
     }
     
-    current_attr = ATTR_LOCAL;
-    main_puts("Terminal Timeout."); main_newline();
+    // Cada velocidad que el driver puede seguir, de menor a mayor, y al
+    // final de vuelta a la de partida
+    for (k = 0; k < BAUD_RATES_COUNT && !in_key_pressed(KEY_BREAK); k++) {
+        if (!uart_rate_usable(baud_rates[k])) continue;
+        if (baud_rates[k] != uart_baud && uart_switch(baud_rates[k]) != SWITCH_OK) continue;
+        bench_run(cmd, n);
+    }
+    if (uart_baud != old_rate && uart_switch(old_rate) != SWITCH_OK) {
+        current_attr = ATTR_LOCAL;
+        main_puts("Could not restore baud rate"); main_newline();
+    }
 }
 
-static void cmd_disconnect(void)
+// ============================================================
+// AT LATENCY (!LAT)
+// ============================================================
+
+// Ida y vuelta de un comando, desde justo antes de enviarlo hasta que
+// at_poll() ve su terminador. FRAMES no vale: da pasos de 20 ms y se salta
+// interrupciones mientras el driver está en DI. Aquí el driver espera
+// siempre, así que basta el tiempo en DI que lleva uart_di_t: la
+// resolución es de media unidad de espera (1.3 ms a 3.5 MHz) y lo que
+// tarda C entre esperas no se cuenta
+
+#define LAT_DEFAULT 20
+#define LAT_MAX     100
+#define LAT_BARS    8       // Filas del histograma
+#define LAT_WIDTH   30      // Columnas de la barra más larga
+
+static const at_txn lat_txn = { 0, 0, TIMEOUT_STD, AT_END };
+static uint16_t lat_times[LAT_MAX];     // ms
+
+// "<n> ms" en la zona principal, con el número alineado a la derecha
+static void lat_ms(uint16_t ms, uint8_t width)
 {
-    current_attr = ATTR_LOCAL;
-    main_puts("Disconnecting...");
-    main_newline();
-    
-    uart_flush_hard();
-    uart_send_string("AT+CWQAP\r\n");
-    wait_at_response();
+    char num[8];
+    uint8_t n;
     
-    strcpy(device_ip, "---");
-    strcpy(device_ssid, "---");
-    device_rssi = 0;
-    connection_status = 0;
-    draw_status_bar();
+    u16_to_dec(num, ms);
+    for (n = strlen(num); n < width; n++) main_putchar(' ');
+    main_puts(num);
 }
 
-static void cmd_ping(void)
+static void cmd_lat(void)
 {
-    uint8_t i;
-    char cmd[40];
+    char cmd[LINE_BUFFER_SIZE + 2], num[8];
+    uint8_t i, j, k, n = 0, ok = 0, errors = 0, peak, count[LAT_BARS];
+    uint16_t ms, lo = 0xFFFF, hi = 0, step;
+    uint32_t t0, t, t_ms, limit, sum = 0;
     
-    // Parse: !PING ip
-    i = 5;
+    // Parse: !LAT [n] [cmd]
+    i = 4;
     while (i < line_len && line_buffer[i] == ' ') i++;
-    
-    if (i >= line_len) {
-        // Default ping
-        strcpy(cmd, "AT+PING=\"8.8.8.8\"\r\n");
-    } else {
-        strcpy(cmd, "AT+PING=\"");
-        uint8_t pos = 9;
-        while (i < line_len && pos < 35) {
-            cmd[pos++] = line_buffer[i++];
-        }
-        cmd[pos++] = '"';
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
-        cmd[pos] = 0;
+    while (i < line_len && line_buffer[i] >= '0' && line_buffer[i] <= '9') n = n * 10 + (line_buffer[i++] - '0');
+    while (i < line_len && line_buffer[i] == ' ') i++;
+    if (n == 0) n = LAT_DEFAULT;
+    if (n > LAT_MAX) n = LAT_MAX;
+    strcpy(cmd, (i < line_len) ? &line_buffer[i] : "AT");
+    strcat(cmd, "\r\n");
+    
+    t_ms = cpu_clock / 1000;
+    limit = TIMEOUT_STD * t_ms;
+    
+    for (k = 0; k < n && !in_key_pressed(KEY_BREAK); k++) {
+        at_sync();
+        t0 = uart_di_t;
+        uart_send_string(cmd);
+        at_begin(0, &lat_txn);
+        
+        while ((j = at_poll()) == RESP_WAITING && uart_di_t - t0 < limit) uart_drain_wait(1);
+        t = uart_di_t - t0;
+        if (j == RESP_WAITING || j == RESP_TIMEOUT) continue;
+        
+        if (j == RESP_GOT_ERROR) errors++;
+        ms = (uint16_t)((t + t_ms / 2) / t_ms);
+        lat_times[ok++] = ms;
+        sum += ms;
+        if (ms < lo) lo = ms;
+        if (ms > hi) hi = ms;
     }
     
     current_attr = ATTR_LOCAL;
-    main_puts("Pinging...");
+    u16_to_dec(num, ok);
+    main_puts(num);
+    main_puts(" replies, ");
+    u16_to_dec(num, k - ok);
+    main_puts(num);
+    main_puts(" timeouts, ");
+    u16_to_dec(num, errors);
+    main_puts(num);
+    main_puts(" errors");
+    main_newline();
+    if (!ok) return;
+    
+    main_puts("min");
+    lat_ms(lo, 5);
+    main_puts(" ms  avg");
+    u16_to_dec(num, (uint16_t)(sum / ok));
+    main_putchar(' ');
+    main_puts(num);
+    main_puts(" ms  max");
+    lat_ms(hi, 5);
+    main_puts(" ms");
     main_newline();
     
-    uart_flush_hard();
-    uart_send_string(cmd);
-    wait_at_response();
-}
-
-static void cmd_baud(void)
-{
-    uint8_t i;
-    char rate[10];
-    
-    // Parse: !BAUD rate
-    i = 5;
-    while (i < line_len && line_buffer[i] == ' ') i++;
-    
-    if (i >= line_len) {
-        current_attr = ATTR_LOCAL;
-        main_puts("Usage: !BAUD rate (9600,19200,38400,115200)");
+    // Histograma: LAT_BARS filas como mucho, cada una de 'step' ms
+    step = (hi - lo) / LAT_BARS + 1;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < ok; i++) count[(lat_times[i] - lo) / step]++;
+    peak = 0;
+    for (i = 0; i < LAT_BARS; i++) if (count[i] > peak) peak = count[i];
+    
+    for (i = 0; i <= (hi - lo) / step; i++) {
+        lat_ms(lo + i * step, 6);
+        if (step > 1) {
+            main_putchar('-');
+            lat_ms(lo + (i + 1) * step - 1, 5);
+        } else {
+            main_puts("      ");
+        }
+        main_puts(" ms ");
+        j = (uint8_t)((uint16_t)count[i] * LAT_WIDTH / peak);
+        if (count[i] && !j) j = 1;
+        while (j--) main_putchar('#');
+        main_putchar(' ');
+        u16_to_dec(num, count[i]);
+        main_puts(num);
         main_newline();
-        return;
-    }
-    
-    // Extract rate
-    uint8_t j = 0;
-    while (i < line_len && j < 9) {
-        rate[j++] = line_buffer[i++];
     }
-    rate[j] = 0;
-    
-    current_attr = ATTR_LOCAL;
-    main_puts("Setting baud to ");
-    main_puts(rate);
-    main_puts("...");
-    main_newline();
-    
-    char cmd[40];
-    strcpy(cmd, "AT+UART_CUR=");
-    strcat(cmd, rate);
-    strcat(cmd, ",8,1,0,0\r\n");
-    
-    uart_flush_hard();
-    uart_send_string(cmd);
-    
-    // Note: After this, communication may break if Z80 side doesn't match
-    main_puts("Note: Z80 UART unchanged. Restart to take effect.");
-    main_newline();
 }
 
-// Help screen with 2 pages
+// Help screen with 3 pages
 
 static void show_help_page1(void)
 {
     clear_zone(MAIN_START, MAIN_LINES, PAPER_BLUE | INK_WHITE);
     
-    print_str64(MAIN_START + 0, 13, "======== ESPAT-ZX HELP (1/2) ========", PAPER_BLUE | INK_WHITE | BRIGHT);
+    print_str64(MAIN_START + 0, 13, "======== ESPAT-ZX HELP (1/3) ========", PAPER_BLUE | INK_WHITE | BRIGHT);
     
     print_str64(MAIN_START + 2, 2, "!CONNECT s,p", PAPER_BLUE | INK_YELLOW | BRIGHT);
     print_str64(MAIN_START + 2, 16, "Connect to WiFi network", PAPER_BLUE | INK_WHITE);
@@ -1907,7 +3786,7 @@ static void show_help_page2(void)
 {
     clear_zone(MAIN_START, MAIN_LINES, PAPER_BLUE | INK_WHITE);
     
-    print_str64(MAIN_START + 0, 13, "======== ESPAT-ZX HELP (2/2) ========", PAPER_BLUE | INK_WHITE | BRIGHT);
+    print_str64(MAIN_START + 0, 13, "======== ESPAT-ZX HELP (2/3) ========", PAPER_BLUE | INK_WHITE | BRIGHT);
     
     print_str64(MAIN_START + 2, 2, "!RST", PAPER_BLUE | INK_YELLOW | BRIGHT);
     print_str64(MAIN_START + 2, 16, "Reset ESP module", PAPER_BLUE | INK_WHITE);
@@ -1916,7 +3795,7 @@ static void show_help_page2(void)
     print_str64(MAIN_START + 3, 16, "Raw traffic monitor", PAPER_BLUE | INK_WHITE);
     
     print_str64(MAIN_START + 4, 2, "!BAUD rate", PAPER_BLUE | INK_YELLOW | BRIGHT);
-    print_str64(MAIN_START + 4, 16, "Change ESP baud rate", PAPER_BLUE | INK_WHITE);
+    print_str64(MAIN_START + 4, 16, "Change UART baud rate", PAPER_BLUE | INK_WHITE);
     
     print_str64(MAIN_START + 5, 2, "!DEBUG", PAPER_BLUE | INK_YELLOW | BRIGHT);
     print_str64(MAIN_START + 5, 16, "Toggle debug output", PAPER_BLUE | INK_WHITE);
@@ -1927,12 +3806,49 @@ static void show_help_page2(void)
     print_str64(MAIN_START + 7, 2, "!ABOUT", PAPER_BLUE | INK_YELLOW | BRIGHT);
     print_str64(MAIN_START + 7, 16, "Show credits", PAPER_BLUE | INK_WHITE);
     
-    print_str64(MAIN_START + 9, 2, "Or type AT commands directly:", PAPER_BLUE | INK_CYAN);
-    print_str64(MAIN_START + 10, 4, "AT+CWJAP=\"SSID\",\"password\"", PAPER_BLUE | INK_WHITE);
-    print_str64(MAIN_START + 11, 4, "AT+CIPSTART=\"TCP\",\"ip\",port", PAPER_BLUE | INK_WHITE);
+    print_str64(MAIN_START + 8, 2, "!FLOW", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 8, 16, "Toggle CTS flow control", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 9, 2, "!UART", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 9, 16, "UART timing report", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 11, 2, "Or type AT commands directly:", PAPER_BLUE | INK_CYAN);
+    print_str64(MAIN_START + 12, 4, "AT+CWJAP=\"SSID\",\"password\"", PAPER_BLUE | INK_WHITE);
+    print_str64(MAIN_START + 13, 4, "AT+CIPSTART=\"TCP\",\"ip\",port", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 14, 2, "Status bar shows:", PAPER_BLUE | INK_CYAN);
+    print_str64(MAIN_START + 15, 4, "IP | SSID | RSSI | Time | Signal | Status", PAPER_BLUE | INK_WHITE);
+    
+    // Footer con instrucciones de navegación
+    print_str64(MAIN_START + 16, 10, "-- SPACE Next | 'B' Back | Other Key Exit --", PAPER_BLUE | INK_WHITE | BRIGHT);
+}
+
+static void show_help_page3(void)
+{
+    clear_zone(MAIN_START, MAIN_LINES, PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 0, 13, "======== ESPAT-ZX HELP (3/3) ========", PAPER_BLUE | INK_WHITE | BRIGHT);
+    
+    print_str64(MAIN_START + 2, 2, "!STATS [R]", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 2, 16, "RX counters (R = reset)", PAPER_BLUE | INK_WHITE);
     
-    print_str64(MAIN_START + 13, 2, "Status bar shows:", PAPER_BLUE | INK_CYAN);
-    print_str64(MAIN_START + 14, 4, "IP | SSID | RSSI | Time | Signal | Status", PAPER_BLUE | INK_WHITE);
+    print_str64(MAIN_START + 3, 2, "!TCP h,port", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 3, 16, "Transparent TCP session", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 4, 2, "!RECV [P|A]", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 4, 16, "Passive/active receive mode", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 5, 2, "!GET url [f]", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 5, 16, "HTTP download to RAM or file", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 6, 2, "!BENCH h:p", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 6, 16, "RX benchmark [bytes] [ALL rates]", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 7, 2, "!LAT [n] [c]", PAPER_BLUE | INK_YELLOW | BRIGHT);
+    print_str64(MAIN_START + 7, 16, "AT round-trip latency histogram", PAPER_BLUE | INK_WHITE);
+    
+    print_str64(MAIN_START + 14, 2, "BREAK", PAPER_BLUE | INK_GREEN | BRIGHT);
+    print_str64(MAIN_START + 14, 16, "Cancel running command", PAPER_BLUE | INK_WHITE);
     
     // Footer con instrucción de volver
     print_str64(MAIN_START + 16, 16, "-- 'B' Back | Any Key Exit --", PAPER_BLUE | INK_WHITE | BRIGHT);
@@ -1979,7 +3895,8 @@ static void show_help_screen(void)
     while (current_page != 0) {
         // Dibujar página actual
         if (current_page == 1) show_help_page1();
-        else show_help_page2();
+        else if (current_page == 2) show_help_page2();
+        else show_help_page3();
         
         // Esperar tecla
         while (in_inkey() != 0) { __asm__("halt"); }
@@ -1987,13 +3904,9 @@ static void show_help_screen(void)
         while (in_inkey() != 0) { __asm__("halt"); }
         
         // Lógica de navegación
-        if (current_page == 1) {
-            if (key == ' ') current_page = 2; // Espacio -> Pag 2
-            else current_page = 0;            // Otra -> Salir
-        } else {
-            if (key == 'b' || key == 'B') current_page = 1; // 'B' -> Volver a Pag 1
-            else current_page = 0;                          // Otra -> Salir
-        }
+        if (key == ' ' && current_page < 3) current_page++;                  // Espacio -> Siguiente
+        else if ((key == 'b' || key == 'B') && current_page > 1) current_page--; // 'B' -> Anterior
+        else current_page = 0;                                                   // Otra -> Salir
     }
     
     // Salir
@@ -2023,6 +3936,14 @@ static uint8_t process_local_command(void)
     if (cmd_match("!DISCONNECT")) { cmd_disconnect(); return 1; }
     if (cmd_match("!PING")) { cmd_ping(); return 1; }
     if (cmd_match("!BAUD")) { cmd_baud(); return 1; }
+    if (cmd_match("!FLOW")) { cmd_flow(); return 1; }
+    if (cmd_match("!UART")) { cmd_uart(); return 1; }
+    if (cmd_match("!STATS")) { cmd_stats(); return 1; }
+    if (cmd_match("!TCP")) { cmd_tcp(); return 1; }
+    if (cmd_match("!RECV")) { cmd_recv(); return 1; }
+    if (cmd_match("!GET")) { cmd_get(); return 1; }
+    if (cmd_match("!BENCH")) { cmd_bench(); return 1; }
+    if (cmd_match("!LAT")) { cmd_lat(); return 1; }
     if (cmd_match("!HELP") || cmd_match("!?")) { cmd_help(); return 1; }
     if (cmd_match("!ABOUT")) { cmd_about(); return 1; }
     return 0;
@@ -2143,12 +4064,55 @@ static void init_screen(void)
     print_char64(INPUT_START, 0, '>', ATTR_PROMPT);
 }
 
+// Líneas tecleadas mientras hay una tarea en curso, en orden
+#define PENDING_SIZE 3
+static char pending[PENDING_SIZE][LINE_BUFFER_SIZE];
+static uint8_t pending_head = 0;
+static uint8_t pending_count = 0;
+
+static void run_line(const char *cmd)
+{
+    char typed[LINE_BUFFER_SIZE];
+    uint8_t typed_len;
+    
+    // Feedback visual en pantalla
+    current_attr = ATTR_USER;
+    main_puts("> ");
+    main_puts(cmd);
+    main_newline();
+    
+    set_input_busy(1);
+    
+    if (cmd[0] == '!') {
+        // Los comandos locales leen sus argumentos de line_buffer, que
+        // puede tener ya lo siguiente que se está tecleando
+        typed_len = line_len;
+        memcpy(typed, line_buffer, typed_len + 1);
+        strcpy(line_buffer, cmd);
+        line_len = strlen(line_buffer);
+        
+        if (!process_local_command()) {
+            current_attr = ATTR_LOCAL;
+            main_puts("Unknown command");
+            main_newline();
+        }
+        
+        memcpy(line_buffer, typed, typed_len + 1);
+        line_len = typed_len;
+    } else {
+        // La respuesta llega en segundo plano (job_poll)
+        execute_raw_at_command(cmd);
+    }
+    
+    draw_status_bar();
+    set_input_busy(0);
+}
+
 // Definiciones de teclas de navegación
 
 void main(void)
 {
     uint8_t c;
-    uint16_t refresh_counter = 0;
     
     init_screen();
     smart_init();
@@ -2163,35 +4127,43 @@ void main(void)
     // ¡AHORA SÍ! Activamos el cursor por primera vez
     redraw_input_from(0);
     while (1) {
-        __asm__("ei");
-        __asm__("halt");  // 50 fps timing base
+        idle_wait_frame();  // 50 fps timing base
+        clock_tick();
         
-        // IDLE: Descartar datos basura del UART directamente (máx 2 bytes/frame)
-        // Esto mantiene el UART limpio sin bloquear el teclado
-        if (ay_uart_ready()) { ay_uart_read(); }
-        if (ay_uart_ready()) { ay_uart_read(); }
+        // WIFI CONNECTED / GOT IP / DISCONNECT llegan aquí y cambian la
+        // barra de estado en el mismo frame. Con una transacción abierta
+        // los atiende ella
+        if (job_state == JOB_IDLE || job_state == JOB_TIMER) idle_events();
         
-        // Auto-refresh de RSSI (~cada 40 segundos a 50fps)
-        refresh_counter++;
-        if (refresh_counter >= 2000 && connection_status == 1) {
-            refresh_counter = 0;
-            
-            set_input_busy(1);
-            
-            uint8_t old_debug = debug_mode;
-            debug_mode = 0;
-            get_ssid_rssi();
-            debug_mode = old_debug;
-            draw_status_bar();
-            
-            set_input_busy(0);
+        if (job_state != JOB_IDLE) {
+            job_poll();
+        } else if (pending_count) {
+            run_line(pending[pending_head]);
+            pending_head = (pending_head + 1) % PENDING_SIZE;
+            pending_count--;
+        } else if (recv_pending && rb_tail == rb_head) {
+            recv_pull();
+        } else {
+            rssi_refresh();
+            if (job_state == JOB_IDLE) clock_resync();
+        }
+        
+        // BREAK corta la tarea en curso y lo que estaba en cola
+        if (in_key_pressed(KEY_BREAK)) {
+            if (job_state != JOB_IDLE || pending_count || recv_pending) {
+                job_cancel();
+                pending_count = 0;
+                recv_pending = 0;
+                current_attr = ATTR_LOCAL;
+                main_puts("[Break]");
+                main_newline();
+            }
+            continue;
         }
         
         c = read_key();
         if (c == 0) continue;
         
-        refresh_counter = 0;
-        
         // --- 1. NAVEGACIÓN SEGURA ---
         
         // Flechas ARRIBA/ABAJO -> Exclusivas para Historial
@@ -2247,47 +4219,29 @@ void main(void)
         }
         else if (c == 13) { // ENTER
             if (line_len > 0) {
-                // Copiamos el buffer
                 char cmd_copy[LINE_BUFFER_SIZE];
+                
+                if (job_state != JOB_IDLE || pending_count) {
+                    // Ocupado: a la cola. Si está llena la línea se queda
+                    // en el input para reintentar
+                    if (pending_count == PENDING_SIZE) continue;
+                    memcpy(pending[(pending_head + pending_count) % PENDING_SIZE], line_buffer, line_len + 1);
+                    pending_count++;
+                    history_add(line_buffer, line_len);
+                    input_clear();
+                    continue;
+                }
+                
+                // Copiamos el buffer
                 memcpy(cmd_copy, line_buffer, line_len + 1);
                 
                 // Guardamos en historial
                 history_add(cmd_copy, line_len);
                 
-                // Feedback visual en pantalla
-                current_attr = ATTR_USER;
-                main_puts("> ");
-                main_puts(cmd_copy);
-                main_newline();
-                
                 // Limpiamos la línea de input inmediatamente
                 input_clear(); 
                 
-                // --- AQUÍ ESTÁ EL TRUCO DEL CURSOR ---
-                set_input_busy(1); // 1. Ocultamos cursor (el input ya está limpio, oculta el prompt '>')
-                                   //    Ojo: input_clear ya dibujó el prompt, así que esto ocultará
-                                   //    el cursor que parpadea sobre el primer carácter vacío.
-
-                if (cmd_copy[0] == '!') {
-                    strcpy(line_buffer, cmd_copy);
-                    line_len = strlen(line_buffer);
-                    
-                    if (!process_local_command()) {
-                        current_attr = ATTR_LOCAL;
-                        main_puts("Unknown command");
-                        main_newline();
-                    }
-                    // Limpiamos tras procesar comando local
-                    line_len = 0; line_buffer[0] = 0;
-                } else {
-                    // Ejecutamos comando AT (Bloqueante)
-                    execute_raw_at_command(cmd_copy);
-                }
-                
-                draw_status_bar();
-                
-                // 2. Restauramos cursor al terminar todo
-                set_input_busy(0); 
+                run_line(cmd_copy);
             }
         }
         // --- 3. TEXTO ---
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Stream generator for the ESPAT-ZX !BENCH command.
+
+Each client sends the number of bytes it wants on one line ("8192\\n") and
+receives that many bytes of the same 16-bit Galois LFSR sequence the
+Spectrum uses to verify them (seed 0xACE1, taps 0xB400, low byte after
+each step). The Spectrum's clock stops while its receiver has interrupts
+off, so the host does the timing: once the client has every byte it sends
+one line back, and the server answers with the milliseconds from the first
+byte sent to that line ("2731\n") before closing. The figure includes the
+return trip of that line, a few tens of ms.
+
+    python3 tools/bench_server.py [--port 8266]
+
+Then on the Spectrum:  !BENCH <this-host-ip>:8266 8192 ALL
+"""
+
+import argparse
+import socketserver
+import time
+
+SEED = 0xACE1
+TAPS = 0xB400
+MAX_BYTES = 1 << 20
+
+
+def lfsr_stream(n):
+    x = SEED
+    out = bytearray(n)
+    for i in range(n):
+        lsb = x & 1
+        x >>= 1
+        if lsb:
+            x ^= TAPS
+        out[i] = x & 0xFF
+    return bytes(out)
+
+
+class BenchHandler(socketserver.StreamRequestHandler):
+    timeout = 10
+
+    def handle(self):
+        try:
+            line = self.rfile.readline(32)
+        except OSError:
+            return
+        try:
+            n = min(int(line.strip() or b"8192"), MAX_BYTES)
+        except ValueError:
+            return
+        data = lfsr_stream(n)
+        print(f"{self.client_address[0]}: sending {n} bytes")
+        t0 = time.monotonic()
+        self.wfile.write(data)
+        self.wfile.flush()
+        # Much of the stream may still be queued here: give the slowest
+        # rate (about 100 B/s) time to take it
+        self.connection.settimeout(self.timeout + n // 100)
+        try:
+            if not self.rfile.readline(32):
+                return
+        except OSError:
+            print(f"{self.client_address[0]}: no reply after the stream")
+            return
+        ms = round((time.monotonic() - t0) * 1000)
+        print(f"{self.client_address[0]}: {n} bytes in {ms} ms, {n * 1000 // max(ms, 1)} B/s")
+        self.wfile.write(b"%d\n" % ms)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--host", default="0.0.0.0")
+    ap.add_argument("--port", type=int, default=8266)
+    args = ap.parse_args()
+    with Server((args.host, args.port), BenchHandler) as srv:
+        print(f"ESPAT-ZX bench server on {args.host}:{args.port}")
+        srv.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""Host-side timing test for the AY UART driver (make test).
+
+Runs ay_uart.asm in a T-state counting Z80 simulator (tools/z80sim.py)
+against a simulated RX/TX line, for each machine clock and baud rate.
+The delay tables are built exactly as uart_calc_timing() builds them, from
+the UART_*_T cost constants read out of espatzx_code.c. Everything
+reported below is measured on the simulated line, so a wrong cost in
+those constants or a changed instruction in ay_uart.asm shows up here
+instead of agreeing with itself.
+
+Per clock and rate: TX bit length and baud error, worst RX sampling
+offset from the bit centre, back-to-back burst rates in both directions
+and whether a +-2% skewed burst is received intact. Per clock: the
+shortest bit the receiver follows back to back, with and without the
+CTS raise at 'max', against UART_MIN_BIT_T/UART_MIN_FLOW_T, and the clock
+found by the start-up calibration from a '\\r'.
+
+Exit status is 1 if any rate the C side treats as usable fails.
+"""
+import os
+import random
+import re
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from z80sim import Asm, CPU, Line  # noqa: E402
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+CLOCKS = ((3500000, '48K'), (3546900, '128K'), (7000000, '7 MHz'), (14000000, '14 MHz'))
+SKEWS = (-0.02, 0.0, 0.02)      # ESP clock against the calibrated one
+TX_ERR_MAX = 2.0                # % allowed on a usable rate
+RX_OFF_MAX = 40.0               # % of a bit, sample to bit centre
+BUF = 0xC000
+
+
+def c_constants():
+    src = open(os.path.join(ROOT, 'espatzx_code.c')).read()
+    k = {m.group(1): int(m.group(2)) for m in re.finditer(r'#define\s+(UART_\w+)\s+(\d+)', src)}
+    rates = re.search(r'baud_rates\[\]\s*=\s*\{([^}]*)\}', src).group(1)
+    return k, [int(r) for r in rates.split(',')]
+
+
+K, RATES = c_constants()
+
+
+def loops(t16):
+    n = (t16 + K['UART_LOOP_T'] * 8) // (K['UART_LOOP_T'] * 16)
+    return max(1, min(255, n))
+
+
+def calc_timing(bit_t16):
+    """uart_calc_timing() from espatzx_code.c."""
+    rx, now = [], 0
+    for i in range(8):
+        now += (K['UART_RX_FIRST_T'] if i == 0 else K['UART_RX_BIT_T']) * 16
+        rx.append(loops(bit_t16 * (3 + 2 * i) // 2 - now))
+        now += rx[-1] * K['UART_LOOP_T'] * 16
+    tx, now = [], 0
+    for i in range(9):
+        now += K['UART_TX_BIT_T'] * 16
+        tx.append(loops(bit_t16 * (i + 1) - now))
+        now += tx[-1] * K['UART_LOOP_T'] * 16
+    tx.append(loops(bit_t16 * 2 - K['UART_TX_STOP_T'] * 16))
+    return rx, tx
+
+
+class Probe(Line):
+    """Line that also logs the time of every poll of port A."""
+
+    def __init__(self, clock):
+        Line.__init__(self, clock)
+        self.reads = []
+
+    def inp(self, cpu, port):
+        self.reads.append((cpu.pc, cpu.t + 9))
+        return Line.inp(self, cpu, port)
+
+
+ASM = Asm(open(os.path.join(ROOT, 'ay_uart.asm')).read())
+ASM.parse()
+SAMPLE_PCS = [ASM.labels['rxDelay%d' % i] + 2 for i in range(8)]
+
+
+def machine(clock, bit_t16):
+    io = Probe(clock)
+    cpu = CPU(ASM, io)
+    io.reg = 14
+    rx, tx = calc_timing(bit_t16)
+    for i, v in enumerate(rx):
+        cpu.mem[ASM.labels['_ay_uart_rx_delays'] + i] = v
+    for i, v in enumerate(tx):
+        cpu.mem[ASM.labels['_ay_uart_tx_delays'] + i] = v
+    return cpu, io
+
+
+def call(cpu, label, *args):
+    for v in args:
+        cpu.push(v)
+    cpu.call(label)
+    cpu.sp = (cpu.sp + 2 * len(args)) & 0xffff
+    return cpu.g16('hl')
+
+
+def read_block(cpu, io, data, rate, t0, maxn=1000, idle=2, slack=0, gap=0.0):
+    cpu.mem[ASM.labels['_ay_uart_rx_slack']] = slack
+    io.schedule_bytes(data, rate, t0, gap_bits=gap)
+    n = call(cpu, '_ay_uart_read_block', BUF, maxn, idle)
+    return bytes(cpu.mem[BUF:BUF + n])
+
+
+def tx_check(clock, rate):
+    """Bit length from the edges of 0x55, burst period and decoded bytes."""
+    cpu, io = machine(clock, clock * 16 // rate)
+    data = b'\x55' + bytes(random.Random(rate).randrange(256) for _ in range(15))
+    cpu.mem[BUF:BUF + len(data)] = data
+    call(cpu, '_ay_uart_send_block', BUF, len(data))
+    edges = [t for t, _ in io.tx_edges]
+    edges = edges[[lvl for _, lvl in io.tx_edges].index(0):]
+    bit_t = (edges[9] - edges[0]) / 9.0
+    starts = [s for _, _, s in io.decode_tx(rate)]
+    period = (starts[-1] - starts[0]) / (len(starts) - 1.0)
+    ok = bytes(v for v, stop, _ in io.decode_tx(rate) if stop) == data
+    return bit_t, clock / period, ok
+
+
+def rx_offset(clock, rate):
+    """Worst distance of a data sample from its bit centre, in % of a bit."""
+    bt = clock / rate
+    worst = 0.0
+    for phase in range(0, 40, 4):
+        cpu, io = machine(clock, clock * 16 // rate)
+        t0 = 1000 + phase
+        if read_block(cpu, io, b'\xa5', rate, t0, idle=1) != b'\xa5':
+            return 100.0
+        samples = [t for pc, t in io.reads if pc in SAMPLE_PCS]
+        for i, t in enumerate(samples[:8]):
+            worst = max(worst, abs(t - t0 - bt * (1.5 + i)) / bt * 100)
+    return worst
+
+
+def burst_ok(clock, bit_t16, rate, maxn=1000, slack=0):
+    """A back-to-back burst at +-2% skew arrives intact (with CTS slack if maxn)."""
+    data = bytes(random.Random(bit_t16).randrange(256) for _ in range(maxn + slack + 8 if slack else 40))
+    want = data[:maxn + slack] if slack else data
+    for skew in SKEWS:
+        for phase in (0, 17):
+            cpu, io = machine(clock, bit_t16)
+            got = read_block(cpu, io, data, rate * (1 + skew), 1000 + phase,
+                             maxn=maxn, idle=2, slack=slack)
+            if got != want:
+                return False
+    return True
+
+
+def shortest_bit(clock, **kw):
+    """Shortest bit (T-states) from which every longer bit also passes."""
+    best = None
+    for t in range(160, 59, -2):
+        if not burst_ok(clock, t * 16, clock / t, **kw):
+            break
+        best = t
+    return best
+
+
+def idle_gaps_ok(clock):
+    """idle = 1 (one unit of 256 polls) must not end a burst on a gap of
+    half a unit between bytes."""
+    cpu, io = machine(clock, clock * 16 // 9600)
+    data = bytes(range(65, 85))
+    gap = 128 * 36 / (clock / 9600.0)
+    return read_block(cpu, io, data, 9600, 1000, idle=1, gap=gap) == data
+
+
+def calibration(clock):
+    """Clock that uart_measure_cr() + uart_calibrate() derive from a '\\r',
+    averaged over start edges at every phase of the 36 T-state poll."""
+    total = 0
+    for phase in range(0, 36, 4):
+        cpu, io = machine(clock, clock * 16 // 9600)
+        io.schedule_bytes(b'\r', 9600, 2000 + phase)
+        cpu.r['l'] = 8
+        cpu.call('_ay_uart_measure')
+        if not cpu.r['l']:
+            return 0
+        e = [cpu.rd16(ASM.labels['_ay_uart_edges'] + 2 * i) for i in range(5)]
+        total += (e[4] - e[0]) * K['UART_MEAS_POLL_T'] + 4 * K['UART_MEAS_EDGE_T']
+    return total * 9600 // (8 * 9)
+
+
+def main():
+    failed = []
+    for clock, name in CLOCKS:
+        print('%s, %d Hz' % (name, clock))
+        print('   Rate  Bit T  TX T/bit  TX err  RX off  TX B/s  Burst  Use')
+        for rate in RATES:
+            usable = clock // rate >= K['UART_MIN_BIT_T']
+            flow = clock // rate >= K['UART_MIN_FLOW_T']
+            bit_t, tx_bps, tx_ok = tx_check(clock, rate)
+            err = (bit_t / (clock / rate) - 1) * 100
+            off = rx_offset(clock, rate)
+            rx_ok = burst_ok(clock, clock * 16 // rate, rate)
+            print('  %5d %6.1f %9.1f %+6.1f%% %6.1f%% %7d  %-5s  %s' % (
+                rate, clock / rate, bit_t, err, off, tx_bps,
+                'ok' if rx_ok and tx_ok else 'FAIL',
+                'RX+F' if flow else 'RX' if usable else '-'))
+            if usable and not (rx_ok and tx_ok and abs(err) <= TX_ERR_MAX and off <= RX_OFF_MAX):
+                failed.append('%s %d bps' % (name, rate))
+            if flow and not burst_ok(clock, clock * 16 // rate, rate, maxn=10, slack=3):
+                failed.append('%s %d bps with CTS slack' % (name, rate))
+
+        t = shortest_bit(clock)
+        print('  back to back: down to %s T/bit (%d bps, %d B/s); UART_MIN_BIT_T %d'
+              % (t, clock // t, clock // t // 10, K['UART_MIN_BIT_T']))
+        if t > K['UART_MIN_BIT_T']:
+            failed.append('%s: UART_MIN_BIT_T below %d' % (name, t))
+        t = shortest_bit(clock, maxn=10, slack=3)
+        print('  CTS raise at max: down to %s T/bit; UART_MIN_FLOW_T %d' % (t, K['UART_MIN_FLOW_T']))
+        if t > K['UART_MIN_FLOW_T']:
+            failed.append('%s: UART_MIN_FLOW_T below %d' % (name, t))
+
+        if not idle_gaps_ok(clock):
+            failed.append('%s: burst cut on a 5-bit gap with idle = 1' % name)
+        cal = calibration(clock)
+        cal_err = (cal / float(clock) - 1) * 100
+        print("  calibration from '\\r' at 9600: %d Hz (%+.2f%%)" % (cal, cal_err))
+        if abs(cal_err) > 0.5:
+            failed.append('%s: calibration off by %.2f%%' % (name, cal_err))
+        print('')
+
+    for f in failed:
+        print('FAIL: ' + f)
+    print('FAILED' if failed else 'OK')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,608 @@
+"""Minimal Z80 assembler and T-state counting simulator for ay_uart.asm.
+
+Only what the driver uses is implemented. Instructions get one pseudo
+address each (code addresses are only used as jump targets), data
+directives get real bytes. Port I/O goes to an I/O model; Line models the
+AY port A with a scripted RX waveform and captures TX/CTS edges. The
+sample point of IN/OUT inside the instruction is fixed, so it cancels out
+between the polls that find an edge and the samples timed from it.
+Used by tools/uart_test.py (make test).
+"""
+import re
+
+R8 = ['b', 'c', 'd', 'e', 'h', 'l', '(hl)', 'a']
+R16 = ['bc', 'de', 'hl', 'sp']
+CC = {'nz': lambda f: not f & 0x40, 'z': lambda f: f & 0x40,
+      'nc': lambda f: not f & 1, 'c': lambda f: f & 1,
+      'po': lambda f: not f & 4, 'pe': lambda f: f & 4,
+      'p': lambda f: not f & 0x80, 'm': lambda f: f & 0x80}
+
+
+def parity(v):
+    return bin(v & 0xff).count('1') % 2 == 0
+
+
+class Asm:
+    def __init__(self, src, org=0x8000):
+        self.src = src
+        self.org = org
+        self.labels = {}
+        self.prog = []  # list of (addr, instr tuple, size)
+
+    def parse(self):
+        lines = []
+        for raw in self.src.split('\n'):
+            line = raw.split(';')[0].strip()
+            if not line:
+                continue
+            lines.append(line)
+        # two passes: sizes are determined by mnemonic, expressions later
+        addr = self.org
+        items = []
+        defcs = {}
+        for line in lines:
+            m = re.match(r'^([A-Za-z_][\w]*):\s*(.*)$', line)
+            if m:
+                self.labels[m.group(1)] = addr
+                line = m.group(2).strip()
+                if not line:
+                    continue
+            low = line.lower()
+            if low.startswith(('section', 'public', 'extern', 'global')):
+                continue
+            if low.startswith('defc'):
+                n, e = line[4:].split('=', 1)
+                defcs[n.strip()] = e.strip()
+                continue
+            m = re.match(r'^([A-Za-z_]\w*)\s+(defs|defb|defw)\s+(.*)$', line, re.I)
+            if m:
+                self.labels[m.group(1)] = addr
+                line = m.group(2) + ' ' + m.group(3)
+                low = line.lower()
+            if low.startswith('defb'):
+                vals = [v.strip() for v in line[4:].split(',')]
+                items.append((addr, 'defb', vals))
+                addr += len(vals)
+                continue
+            if low.startswith('defw'):
+                vals = [v.strip() for v in line[4:].split(',')]
+                items.append((addr, 'defw', vals))
+                addr += 2 * len(vals)
+                continue
+            if low.startswith('defs'):
+                n = int(self.evalexpr(line[4:].strip().split(',')[0]))
+                items.append((addr, 'defs', n))
+                addr += n
+                continue
+            parts = line.split(None, 1)
+            op = parts[0].lower()
+            args = [a.strip() for a in self.split_args(parts[1])] if len(parts) > 1 else []
+            items.append((addr, op, args))
+            addr += 1  # instructions occupy 1 pseudo-byte (code addresses only)
+        self.defcs = defcs
+        self.items = items
+        self.end = addr
+
+    @staticmethod
+    def split_args(s):
+        out, depth, cur = [], 0, ''
+        for ch in s:
+            if ch == '(':
+                depth += 1
+            if ch == ')':
+                depth -= 1
+            if ch == ',' and depth == 0:
+                out.append(cur)
+                cur = ''
+            else:
+                cur += ch
+        out.append(cur)
+        return out
+
+    def evalexpr(self, e):
+        e = e.strip()
+        env = dict(self.labels)
+        for k, v in getattr(self, 'defcs', {}).items():
+            if k not in env and k in e:
+                env[k] = self.evalexpr(v)
+        ee = re.sub(r'0x([0-9a-fA-F]+)', lambda m: str(int(m.group(1), 16)), e)
+        ee = re.sub(r'\$([0-9a-fA-F]+)', lambda m: str(int(m.group(1), 16)), ee)
+        return int(eval(ee, {}, env))
+
+
+class CPU:
+    def __init__(self, asm, io):
+        self.asm = asm
+        self.mem = bytearray(65536)
+        self.code = {}
+        for addr, op, args in asm.items:
+            if op == 'defb':
+                for i, v in enumerate(args):
+                    self.mem[addr + i] = asm.evalexpr(v) & 0xff
+            elif op == 'defw':
+                for i, v in enumerate(args):
+                    x = asm.evalexpr(v)
+                    self.mem[addr + 2 * i] = x & 0xff
+                    self.mem[addr + 2 * i + 1] = x >> 8
+            elif op == 'defs':
+                pass
+            else:
+                self.code[addr] = (op, args)
+        self.r = dict(a=0, f=0, b=0, c=0, d=0, e=0, h=0, l=0,
+                      a_=0, f_=0, b_=0, c_=0, d_=0, e_=0, h_=0, l_=0,
+                      ixh=0, ixl=0, iyh=0, iyl=0)
+        self.sp = 0xff00
+        self.pc = 0
+        self.t = 0
+        self.iff = 0
+        self.io = io
+        self.halted = False
+
+    # helpers
+    def g16(self, rr):
+        if rr == 'sp':
+            return self.sp
+        if rr == 'af':
+            return self.r['a'] << 8 | self.r['f']
+        if rr in ('ix', 'iy'):
+            return self.r[rr + 'h'] << 8 | self.r[rr + 'l']
+        return self.r[rr[0]] << 8 | self.r[rr[1]]
+
+    def s16(self, rr, v):
+        v &= 0xffff
+        if rr == 'sp':
+            self.sp = v
+        elif rr == 'af':
+            self.r['a'], self.r['f'] = v >> 8, v & 0xff
+        elif rr in ('ix', 'iy'):
+            self.r[rr + 'h'], self.r[rr + 'l'] = v >> 8, v & 0xff
+        else:
+            self.r[rr[0]], self.r[rr[1]] = v >> 8, v & 0xff
+
+    def rd16(self, a):
+        return self.mem[a] | self.mem[(a + 1) & 0xffff] << 8
+
+    def wr16(self, a, v):
+        self.mem[a] = v & 0xff
+        self.mem[(a + 1) & 0xffff] = (v >> 8) & 0xff
+
+    def push(self, v):
+        self.sp = (self.sp - 2) & 0xffff
+        self.wr16(self.sp, v)
+
+    def pop(self):
+        v = self.rd16(self.sp)
+        self.sp = (self.sp + 2) & 0xffff
+        return v
+
+    def ev(self, e):
+        return self.asm.evalexpr(e)
+
+    def get8(self, x):
+        xl = x.lower()
+        if xl in self.r and len(xl) <= 3 and xl not in ('a_',):
+            return self.r[xl]
+        if xl == '(hl)':
+            return self.mem[self.g16('hl')]
+        if xl == '(de)':
+            return self.mem[self.g16('de')]
+        if xl == '(bc)':
+            return self.mem[self.g16('bc')]
+        m = re.match(r'\((ix|iy)\s*([+-].*)?\)', xl)
+        if m:
+            d = self.ev(m.group(2)) if m.group(2) else 0
+            return self.mem[(self.g16(m.group(1)) + d) & 0xffff]
+        if x.startswith('('):
+            return self.mem[self.ev(x[1:-1]) & 0xffff]
+        return self.ev(x) & 0xff
+
+    def set8(self, x, v):
+        v &= 0xff
+        xl = x.lower()
+        if xl in self.r and len(xl) <= 3:
+            self.r[xl] = v
+            return
+        if xl == '(hl)':
+            self.mem[self.g16('hl')] = v
+            return
+        if xl == '(de)':
+            self.mem[self.g16('de')] = v
+            return
+        if xl == '(bc)':
+            self.mem[self.g16('bc')] = v
+            return
+        m = re.match(r'\((ix|iy)\s*([+-].*)?\)', xl)
+        if m:
+            d = self.ev(m.group(2)) if m.group(2) else 0
+            self.mem[(self.g16(m.group(1)) + d) & 0xffff] = v
+            return
+        if x.startswith('('):
+            self.mem[self.ev(x[1:-1]) & 0xffff] = v
+            return
+        raise ValueError(x)
+
+    def szp(self, v, c=0, h=0, n=0, pv=None):
+        f = (v & 0x80) | (0x40 if v == 0 else 0) | (0x10 if h else 0) | (2 if n else 0) | (1 if c else 0)
+        if pv is None:
+            pv = parity(v)
+        if pv:
+            f |= 4
+        self.r['f'] = f
+
+    def step(self):
+        if self.pc not in self.code:
+            raise RuntimeError('pc out of code: %04x' % self.pc)
+        op, a = self.code[self.pc]
+        npc = self.pc + 1
+        t = 4
+        r = self.r
+        A = [x.lower() for x in a]
+        F = r['f']
+        if op == 'nop':
+            t = 4
+        elif op == 'di':
+            self.iff = 0
+        elif op == 'ei':
+            self.iff = 1
+        elif op == 'halt':
+            t = 4
+            self.io.halt(self)
+        elif op == 'exx':
+            for x in 'bcdehl':
+                r[x], r[x + '_'] = r[x + '_'], r[x]
+        elif op == 'ex':
+            if A == ['af', "af'"]:
+                r['a'], r['a_'] = r['a_'], r['a']
+                r['f'], r['f_'] = r['f_'], r['f']
+            elif A == ['de', 'hl']:
+                d, h = self.g16('de'), self.g16('hl')
+                self.s16('de', h)
+                self.s16('hl', d)
+            elif A == ['(sp)', 'hl']:
+                v = self.rd16(self.sp)
+                self.wr16(self.sp, self.g16('hl'))
+                self.s16('hl', v)
+                t = 19
+            else:
+                raise ValueError(a)
+        elif op == 'ld':
+            d, s = A
+            if d in ('bc', 'de', 'hl', 'sp', 'ix', 'iy'):
+                if s in ('hl', 'ix', 'iy') and d == 'sp':
+                    self.sp = self.g16(s)
+                    t = 6
+                elif s.startswith('('):
+                    self.s16(d, self.rd16(self.ev(a[1][1:-1])))
+                    t = 16 if d == 'hl' else 20
+                else:
+                    self.s16(d, self.ev(a[1]))
+                    t = 10 if d not in ('ix', 'iy') else 14
+            elif s in ('bc', 'de', 'hl', 'sp', 'ix', 'iy') and d.startswith('('):
+                self.wr16(self.ev(a[0][1:-1]), self.g16(s))
+                t = 16 if s == 'hl' else 20
+            else:
+                v = self.get8(a[1])
+                self.set8(a[0], v)
+                if d in R8 and s in R8 and '(hl)' not in (d, s):
+                    t = 4
+                elif d in ('ixh', 'ixl', 'iyh', 'iyl') or s in ('ixh', 'ixl', 'iyh', 'iyl'):
+                    t = 8
+                elif 'ix' in d or 'iy' in d or 'ix' in s or 'iy' in s:
+                    t = 19
+                elif d == '(hl)' or s == '(hl)':
+                    t = 10 if (d == '(hl)' and s not in R8) else 7
+                elif d in ('(de)', '(bc)') or s in ('(de)', '(bc)'):
+                    t = 7
+                elif d.startswith('(') or s.startswith('('):
+                    t = 13
+                else:
+                    t = 7
+        elif op in ('push', 'pop'):
+            if op == 'push':
+                self.push(self.g16(A[0]))
+                t = 11 if A[0] not in ('ix', 'iy') else 15
+            else:
+                self.s16(A[0], self.pop())
+                t = 10 if A[0] not in ('ix', 'iy') else 14
+        elif op in ('inc', 'dec'):
+            x = A[0]
+            dlt = 1 if op == 'inc' else -1
+            if x in ('bc', 'de', 'hl', 'sp', 'ix', 'iy'):
+                self.s16(x, self.g16(x) + dlt)
+                t = 6 if x not in ('ix', 'iy') else 10
+            else:
+                v = (self.get8(a[0]) + dlt) & 0xff
+                self.set8(a[0], v)
+                h = (v & 0xf) == (0 if dlt == 1 else 0xf)
+                pv = (v == 0x80) if dlt == 1 else (v == 0x7f)
+                self.szp(v, c=F & 1, h=h, n=dlt < 0, pv=pv)
+                t = 11 if x == '(hl)' else (8 if x in ('ixh', 'ixl') else 4)
+        elif op in ('add', 'adc', 'sub', 'sbc', 'and', 'or', 'xor', 'cp'):
+            if op in ('add', 'adc', 'sbc') and A[0] in ('hl', 'ix', 'iy') and len(A) == 2:
+                x = self.g16(A[0])
+                y = self.g16(A[1])
+                if op == 'add':
+                    res = x + y
+                    r['f'] = (F & 0xc4) | (1 if res > 0xffff else 0)
+                    t = 11 if A[0] == 'hl' else 15
+                else:
+                    cy = F & 1
+                    if op == 'adc':
+                        res = x + y + cy
+                        c = res > 0xffff
+                    else:
+                        res = x - y - cy
+                        c = res < 0
+                    res &= 0xffff
+                    f = (res >> 8) & 0x80 | (0x40 if res == 0 else 0) | (1 if c else 0) | (2 if op == 'sbc' else 0)
+                    r['f'] = f
+                    t = 15
+                self.s16(A[0], res)
+            else:
+                if len(A) == 2:
+                    src = a[1]
+                else:
+                    src = a[0]
+                sl = src.lower()
+                y = self.get8(src)
+                x = r['a']
+                t = 4 if sl in R8 and sl != '(hl)' else (7 if sl == '(hl)' or not sl.startswith('(') else 19)
+                if sl in ('ixh', 'ixl', 'iyh', 'iyl'):
+                    t = 8
+                if op in ('and', 'or', 'xor'):
+                    v = (x & y) if op == 'and' else (x | y) if op == 'or' else (x ^ y)
+                    self.szp(v, h=op == 'and')
+                    r['a'] = v
+                else:
+                    cy = F & 1 if op in ('adc', 'sbc') else 0
+                    if op in ('add', 'adc'):
+                        res = x + y + cy
+                        v = res & 0xff
+                        ov = ((x ^ ~y) & (x ^ v) & 0x80) != 0
+                        self.szp(v, c=res > 0xff, h=((x & 0xf) + (y & 0xf) + cy) > 0xf, pv=ov)
+                    else:
+                        res = x - y - cy
+                        v = res & 0xff
+                        ov = ((x ^ y) & (x ^ v) & 0x80) != 0
+                        self.szp(v, c=res < 0, h=((x & 0xf) - (y & 0xf) - cy) < 0, n=1, pv=ov)
+                    if op != 'cp':
+                        r['a'] = v
+        elif op == 'cpl':
+            r['a'] ^= 0xff
+            r['f'] |= 0x12
+        elif op == 'scf':
+            r['f'] = (F & 0xc4) | 1
+        elif op == 'ccf':
+            r['f'] = (F & 0xc4) | ((F & 1) ^ 1)
+        elif op in ('rra', 'rla', 'rrca', 'rlca'):
+            x = r['a']
+            c = F & 1
+            if op == 'rra':
+                nc, v = x & 1, (x >> 1) | (c << 7)
+            elif op == 'rla':
+                nc, v = x >> 7, ((x << 1) | c) & 0xff
+            elif op == 'rrca':
+                nc, v = x & 1, (x >> 1) | ((x & 1) << 7)
+            else:
+                nc, v = x >> 7, ((x << 1) | (x >> 7)) & 0xff
+            r['a'] = v
+            r['f'] = (F & 0xc4) | nc
+        elif op in ('rr', 'rl', 'srl', 'sla', 'rrc', 'rlc', 'sra'):
+            x = self.get8(a[0])
+            c = F & 1
+            if op == 'rr':
+                nc, v = x & 1, (x >> 1) | (c << 7)
+            elif op == 'rl':
+                nc, v = x >> 7, ((x << 1) | c) & 0xff
+            elif op == 'srl':
+                nc, v = x & 1, x >> 1
+            elif op == 'sra':
+                nc, v = x & 1, (x >> 1) | (x & 0x80)
+            elif op == 'sla':
+                nc, v = x >> 7, (x << 1) & 0xff
+            elif op == 'rrc':
+                nc, v = x & 1, (x >> 1) | ((x & 1) << 7)
+            else:
+                nc, v = x >> 7, ((x << 1) | (x >> 7)) & 0xff
+            self.set8(a[0], v)
+            self.szp(v, c=nc)
+            t = 15 if A[0] == '(hl)' else 8
+        elif op == 'bit':
+            n = self.ev(a[0])
+            v = self.get8(a[1])
+            z = not (v >> n) & 1
+            r['f'] = (F & 1) | 0x10 | (0x40 | 4 if z else 0) | (0x80 if n == 7 and not z else 0)
+            t = 12 if A[1] == '(hl)' else 8
+        elif op in ('set', 'res'):
+            n = self.ev(a[0])
+            v = self.get8(a[1])
+            v = v | (1 << n) if op == 'set' else v & ~(1 << n)
+            self.set8(a[1], v)
+            t = 15 if A[1] == '(hl)' else 8
+        elif op in ('jp', 'jr', 'call'):
+            if len(A) == 2:
+                cc, tgt = A[0], a[1]
+                take = CC[cc](F)
+            else:
+                tgt = a[0]
+                take = True
+            if op == 'jp':
+                if tgt.lower() == '(hl)':
+                    npc = self.g16('hl')
+                    t = 4
+                else:
+                    t = 10
+                    if take:
+                        npc = self.tgt(tgt)
+            elif op == 'jr':
+                t = 12 if take else 7
+                if take:
+                    npc = self.tgt(tgt)
+            else:
+                if take:
+                    self.push(npc)
+                    npc = self.tgt(tgt)
+                    t = 17
+                else:
+                    t = 10
+        elif op == 'djnz':
+            r['b'] = (r['b'] - 1) & 0xff
+            if r['b']:
+                npc = self.tgt(a[0])
+                t = 13
+            else:
+                t = 8
+        elif op == 'ret':
+            if A:
+                if CC[A[0]](F):
+                    npc = self.pop()
+                    t = 11
+                else:
+                    t = 5
+            else:
+                npc = self.pop()
+                t = 10
+        elif op == 'out':
+            if A[0] == '(c)':
+                self.t += 9
+                self.io.out(self, self.g16('bc'), r[A[1]])
+                self.t -= 9
+                t = 12
+            else:
+                port = (r['a'] << 8) | self.ev(a[0][1:-1])
+                self.io.out(self, port, r['a'])
+                t = 11
+        elif op == 'in':
+            if A[1] == '(c)':
+                self.t += 9
+                v = self.io.inp(self, self.g16('bc'))
+                self.t -= 9
+                if A[0] != 'f':
+                    r[A[0]] = v
+                self.szp(v, c=F & 1)
+                t = 12
+            else:
+                port = (r['a'] << 8) | self.ev(a[1][1:-1])
+                r['a'] = self.io.inp(self, port)
+                t = 11
+        elif op == 'ldir':
+            while True:
+                self.mem[self.g16('de')] = self.mem[self.g16('hl')]
+                self.s16('hl', self.g16('hl') + 1)
+                self.s16('de', self.g16('de') + 1)
+                self.s16('bc', self.g16('bc') - 1)
+                self.t += 21
+                if self.g16('bc') == 0:
+                    break
+            t = -5
+        else:
+            raise ValueError('unsupported op %s %s' % (op, a))
+        self.t += t
+        self.pc = npc
+
+    def tgt(self, s):
+        s = s.strip()
+        if s == '$':
+            return self.pc
+        if s.startswith('$'):
+            raise ValueError('relative $ not supported: ' + s)
+        return self.ev(s)
+
+    def call(self, label, max_t=10**9):
+        self.push(0xfffe)
+        self.pc = self.asm.labels[label]
+        start = self.t
+        while self.pc != 0xfffe:
+            self.step()
+            if self.t - start > max_t:
+                raise RuntimeError('timeout in %s' % label)
+
+
+class Line:
+    """AY port A model: RX line (bit 7) driven by a scripted waveform, TX (bit 3) captured."""
+
+    def __init__(self, clock=3500000):
+        self.reg = 0
+        self.porta = 0xff
+        self.rx_edges = []   # list of (t, level)
+        self.tx_edges = []
+        self.cts_edges = []
+        self.clock = clock
+        self.frame = 69888
+
+    def rx_level(self, t):
+        lvl = 1
+        for et, l in self.rx_edges:
+            if et > t:
+                break
+            lvl = l
+        return lvl
+
+    def schedule_bytes(self, data, baud, t0, gap_bits=0.0, stop_bits=1):
+        bt = self.clock / baud
+        t = t0
+        for b in data:
+            bits = [0] + [(b >> i) & 1 for i in range(8)] + [1] * stop_bits
+            for bit in bits:
+                self.rx_edges.append((int(t), bit))
+                t += bt
+            t += gap_bits * bt
+        self.rx_edges.append((int(t), 1))
+        self.rx_edges.sort()
+        return t
+
+    def inp(self, cpu, port):
+        if port & 0xc002 == 0xc000:
+            if self.reg == 14:
+                return (self.porta & 0x7f) | (self.rx_level(cpu.t) << 7)
+            return 0xff
+        return 0xff
+
+    def out(self, cpu, port, v):
+        if port & 0xc002 == 0xc000:
+            self.reg = v & 0x0f
+        elif port & 0xc002 == 0x8000:
+            if self.reg == 14:
+                old = self.porta
+                self.porta = v
+                if (old ^ v) & 0x08 or not self.tx_edges:
+                    self.tx_edges.append((cpu.t, (v >> 3) & 1))
+                if (old ^ v) & 0x04:
+                    self.cts_edges.append((cpu.t, (v >> 2) & 1))
+
+    def halt(self, cpu):
+        cpu.t = (cpu.t // self.frame + 1) * self.frame
+
+    def decode_tx(self, baud, t_start=0):
+        bt = self.clock / baud
+        edges = [e for e in self.tx_edges if e[0] >= t_start]
+        if not edges:
+            return b''
+
+        def lvl(t):
+            L = 1
+            for et, l in self.tx_edges:
+                if et > t:
+                    break
+                L = l
+            return L
+        out = []
+        t = edges[0][0]
+        end = self.tx_edges[-1][0] + 12 * bt
+        # find falling edges
+        while t < end:
+            # search next falling edge
+            nxt = None
+            for et, l in self.tx_edges:
+                if et >= t and l == 0 and lvl(et - 1) == 1:
+                    nxt = et
+                    break
+            if nxt is None:
+                break
+            v = 0
+            for i in range(8):
+                v |= lvl(nxt + bt * (1.5 + i)) << i
+            stop = lvl(nxt + bt * 9.5)
+            out.append((v, stop, nxt))
+            t = nxt + bt * 9.6
+        return out